@@ -13,24 +13,31 @@ size_t Function::SearchBlock(size_t address) const
         return -1;
     }
 
-    for (size_t i = 0; i < blocks.size(); i++)
+    // Blocks are sorted by base once analysis is done.
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), address - base, [](size_t offset, const Block& block)
     {
-        const auto& block = blocks[i];
-        const auto begin = base + block.base;
-        const auto end = begin + block.size;
+        return offset < block.base;
+    });
+
+    while (it != blocks.begin())
+    {
+        --it;
+
+        const auto begin = base + it->base;
+        const auto end = begin + it->size;
 
         if (begin != end)
         {
             if (address >= begin && address < end)
             {
-                return i;
+                return it - blocks.begin();
             }
         }
         else // fresh block
         {
             if (address == begin)
             {
-                return i;
+                return it - blocks.begin();
             }
         }
     }
@@ -38,6 +45,30 @@ size_t Function::SearchBlock(size_t address) const
     return -1;
 }
 
+// Marks which instructions are covered by a block while a function is being analysed,
+// as blocks are unsorted and growing at that point. Grown lazily, since the function size is unknown.
+struct BlockCoverage
+{
+    std::vector<uint64_t> bits;
+
+    bool Test(size_t offset) const
+    {
+        const size_t index = offset / sizeof(uint32_t);
+        return (index / 64) < bits.size() && (bits[index / 64] & (1ull << (index % 64))) != 0;
+    }
+
+    void Set(size_t offset)
+    {
+        const size_t index = offset / sizeof(uint32_t);
+        if ((index / 64) >= bits.size())
+        {
+            bits.resize((index / 64) + 1);
+        }
+
+        bits[index / 64] |= 1ull << (index % 64);
+    }
+};
+
 Function Function::Analyze(const void* code, size_t size, size_t base)
 {
     Function fn{ base, 0 };
@@ -52,6 +83,30 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
     blocks.reserve(8);
     blocks.emplace_back();
 
+    BlockCoverage coverage;
+
+    // Blocks before base can never be found, see SearchBlock.
+    auto coverBlock = [&](size_t offset)
+    {
+        if (base + offset >= base)
+        {
+            coverage.Set(offset);
+        }
+    };
+
+    // Same result as SearchBlock for the purpose of knowing whether a block exists.
+    auto searchBlock = [&](size_t address) -> size_t
+    {
+        if (address < base || !coverage.Test(address - base))
+        {
+            return -1;
+        }
+
+        return 0;
+    };
+
+    coverBlock(0);
+
     const auto* data = (uint32_t*)code;
     const auto* dataStart = data;
     const auto* dataEnd = (uint32_t*)((uint8_t*)code + size);
@@ -90,6 +145,7 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
             continue;
         }
 
+        coverBlock(curBlock.base + curBlock.size);
         curBlock.size += 4;
         if (op == PPC_OP_BC) // conditional branches all originate from one opcode, thanks RISC
         {
@@ -113,11 +169,12 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
             const size_t rBase = (addr + PPC_BD(instruction)) - base;
 
             // these will be -1 if it's our first time seeing these blocks
-            auto lBlock = fn.SearchBlock(base + lBase);
+            auto lBlock = searchBlock(base + lBase);
 
             if (lBlock == -1)
             {
                 blocks.emplace_back(lBase, 0).projectedSize = rBase - lBase;
+                coverBlock(lBase);
                 lBlock = blocks.size() - 1;
 
                 // push this first, this gets overriden by the true case as it'd be further away
@@ -125,10 +182,11 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
                 blockStack.emplace_back(lBlock);
             }
 
-            size_t rBlock = fn.SearchBlock(base + rBase);
+            size_t rBlock = searchBlock(base + rBase);
             if (rBlock == -1)
             {
                 blocks.emplace_back(branchDest - base, 0);
+                coverBlock(branchDest - base);
                 rBlock = blocks.size() - 1;
 
                 DEBUG(blocks[rBlock].parent = blockBase);
@@ -149,7 +207,7 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
                     const size_t branchDest = addr + PPC_BI(instruction);
 
                     const size_t branchBase = branchDest - base;
-                    const size_t branchBlock = fn.SearchBlock(branchDest);
+                    const size_t branchBlock = searchBlock(branchDest);
 
                     if (branchDest < base)
                     {
@@ -170,6 +228,7 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
                     if (branchBlock == -1)
                     {
                         blocks.emplace_back(branchBase, 0, sizeProjection);
+                        coverBlock(branchBase);
 
                         blockStack.emplace_back(blocks.size() - 1);
                         
@@ -186,10 +245,11 @@ Function Function::Analyze(const void* code, size_t size, size_t base)
                     {
                         // right block's just going to return
                         const size_t lBase = (addr - base) + 4;
-                        size_t lBlock = fn.SearchBlock(lBase);
+                        size_t lBlock = searchBlock(lBase);
                         if (lBlock == -1)
                         {
                             blocks.emplace_back(lBase, 0);
+                            coverBlock(lBase);
                             lBlock = blocks.size() - 1;
 
                             DEBUG(blocks[lBlock].parent = blockBase);
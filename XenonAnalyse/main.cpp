@@ -1,8 +1,12 @@
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <fstream>
 #include <iterator>
-#include <file.h>
+#include <memory_mapped_file.h>
 #include <disasm.h>
 #include <image.h>
+#include <parallel.h>
 #include <xbox.h>
 #include <fmt/core.h>
 #include "function.h"
@@ -19,120 +23,346 @@ struct SwitchTable
     size_t defaultLabel{};
     uint32_t r{};
     uint32_t type{};
+    size_t tableAddress{};
+    size_t labelBase{};
+    uint32_t shift{};
 };
 
-void ReadTable(Image& image, SwitchTable& table)
+// Reads the labels of a jump table, fails if the table is unmapped or runs past the end of its section.
+bool ReadTable(Image& image, SwitchTable& table)
 {
-    uint32_t pOffset;
-    ppc_insn insn;
-    auto* code = (uint32_t*)image.Find(table.base);
-    ppc::Disassemble(code, table.base, insn);
-    pOffset = insn.operands[1] << 16;
-
-    ppc::Disassemble(code + 1, table.base + 4, insn);
-    pOffset += insn.operands[2];
-
     if (table.type == SWITCH_ABSOLUTE)
     {
-        const auto* offsets = (be<uint32_t>*)image.Find(pOffset);
+        const auto* offsets = (be<uint32_t>*)image.Find(table.tableAddress, table.labels.size() * sizeof(uint32_t));
+        if (offsets == nullptr)
+            return false;
+
         for (size_t i = 0; i < table.labels.size(); i++)
         {
             table.labels[i] = offsets[i];
         }
     }
-    else if (table.type == SWITCH_COMPUTED)
+    else if (table.type == SWITCH_COMPUTED || table.type == SWITCH_BYTEOFFSET)
     {
-        uint32_t base;
-        uint32_t shift;
-        const auto* offsets = (uint8_t*)image.Find(pOffset);
+        const auto* offsets = (uint8_t*)image.Find(table.tableAddress, table.labels.size() * sizeof(uint8_t));
+        if (offsets == nullptr)
+            return false;
 
-        ppc::Disassemble(code + 4, table.base + 0x10, insn);
-        base = insn.operands[1] << 16;
+        for (size_t i = 0; i < table.labels.size(); i++)
+        {
+            table.labels[i] = table.labelBase + (offsets[i] << table.shift);
+        }
+    }
+    else if (table.type == SWITCH_SHORTOFFSET)
+    {
+        const auto* offsets = (be<uint16_t>*)image.Find(table.tableAddress, table.labels.size() * sizeof(uint16_t));
+        if (offsets == nullptr)
+            return false;
 
-        ppc::Disassemble(code + 5, table.base + 0x14, insn);
-        base += insn.operands[2];
+        for (size_t i = 0; i < table.labels.size(); i++)
+        {
+            table.labels[i] = table.labelBase + offsets[i];
+        }
+    }
+    else
+    {
+        assert(false);
+        return false;
+    }
 
-        ppc::Disassemble(code + 3, table.base + 0x0C, insn);
-        shift = insn.operands[2];
+    return true;
+}
 
-        for (size_t i = 0; i < table.labels.size(); i++)
+// Walks backwards from a bctr through the straight-line code leading up to it, and follows
+// the registers that feed the count register to recover the jump table regardless of instruction order.
+struct SwitchSlicer
+{
+    static constexpr size_t MAX_DISTANCE = 64;
+
+    // insns[0] is the bctr, insns[i] is i instructions before it.
+    std::vector<ppc_insn> insns;
+
+    SwitchSlicer(const uint32_t* code, size_t base, size_t maxDistance)
+    {
+        maxDistance = std::min(maxDistance, MAX_DISTANCE);
+        insns.reserve(maxDistance + 1);
+
+        for (size_t i = 0; i <= maxDistance; i++)
         {
-            table.labels[i] = base + (offsets[i] << shift);
+            auto& insn = insns.emplace_back();
+            ppc::Disassemble(code - i, base - i * 4, insn);
+
+            // Code before an unconditional branch does not flow into the bctr.
+            if (i != 0 && (insn.opcode == nullptr || IsBlockEnd(insn)))
+            {
+                insns.pop_back();
+                break;
+            }
         }
     }
-    else if (table.type == SWITCH_BYTEOFFSET || table.type == SWITCH_SHORTOFFSET)
+
+    static bool IsBlockEnd(const ppc_insn& insn)
     {
-        if (table.type == SWITCH_BYTEOFFSET)
+        switch (insn.opcode->id)
         {
-            const auto* offsets = (uint8_t*)image.Find(pOffset);
-            uint32_t base;
+        case PPC_INST_B:
+        case PPC_INST_BLR:
+        case PPC_INST_BCTR:
+            return true;
+        }
 
-            ppc::Disassemble(code + 3, table.base + 0x0C, insn);
-            base = insn.operands[1] << 16;
+        return false;
+    }
 
-            ppc::Disassemble(code + 4, table.base + 0x10, insn);
-            base += insn.operands[2];
+    // Conservatively tells whether an instruction may change a general purpose register.
+    static bool IsDefinition(const ppc_insn& insn, uint32_t r)
+    {
+        const uint32_t op = PPC_OP(insn.instruction);
+        const char* name = insn.opcode->name;
+        const bool isUpdate = strchr(name, 'u') != nullptr;
+
+        if (op == PPC_OP_SC)
+            return true;
+
+        // Calls clobber the volatile registers.
+        if (op == PPC_OP_B || op == PPC_OP_BC || op == PPC_OP_CTR)
+            return PPC_BL(insn.instruction) && (r == 0 || (r >= 3 && r <= 12));
+
+        // Stores and floating point/vector loads only write back the address register in their update forms.
+        if (strncmp(name, "st", 2) == 0 || strncmp(name, "lf", 2) == 0 || strncmp(name, "lv", 2) == 0)
+            return isUpdate && (insn.operands[1] == r || insn.operands[2] == r);
+
+        if (strncmp(name, "cmp", 3) == 0 || strncmp(name, "tw", 2) == 0 || strncmp(name, "td", 2) == 0 ||
+            strncmp(name, "mt", 2) == 0 || strncmp(name, "dcb", 3) == 0 || strncmp(name, "icb", 3) == 0 ||
+            strcmp(name, "mffs") == 0 || strcmp(name, "mfvscr") == 0 || name[0] == 'f' || name[0] == 'v' ||
+            strcmp(name, "sync") == 0 || strcmp(name, "lwsync") == 0 || strcmp(name, "eieio") == 0 ||
+            strcmp(name, "isync") == 0 || strcmp(name, "nop") == 0)
+        {
+            return false;
+        }
 
-            for (size_t i = 0; i < table.labels.size(); i++)
+        if (insn.operands[0] == r)
+            return true;
+
+        // Integer loads with update.
+        return name[0] == 'l' && isUpdate && (insn.operands[1] == r || insn.operands[2] == r);
+    }
+
+    // Returns the index of the closest instruction before "from" that may write to the register.
+    size_t FindDefinition(uint32_t r, size_t from) const
+    {
+        for (size_t i = from + 1; i < insns.size(); i++)
+        {
+            if (IsDefinition(insns[i], r))
+                return i;
+        }
+
+        return -1;
+    }
+
+    bool ResolveConstant(uint32_t r, size_t from, uint32_t& value) const
+    {
+        const size_t def = FindDefinition(r, from);
+        if (def == -1)
+            return false;
+
+        const auto& insn = insns[def];
+        switch (insn.opcode->id)
+        {
+        case PPC_INST_LIS:
+            value = insn.operands[1] << 16;
+            return true;
+
+        case PPC_INST_LI:
+            value = insn.operands[1];
+            return true;
+
+        case PPC_INST_ADDI:
+            if (insn.operands[1] == 0)
             {
-                table.labels[i] = base + offsets[i];
+                value = insn.operands[2];
+                return true;
             }
+            if (!ResolveConstant(insn.operands[1], def, value))
+                return false;
+            value += insn.operands[2];
+            return true;
+
+        case PPC_INST_ADDIS:
+            if (!ResolveConstant(insn.operands[1], def, value))
+                return false;
+            value += insn.operands[2] << 16;
+            return true;
+
+        case PPC_INST_ORI:
+            if (!ResolveConstant(insn.operands[1], def, value))
+                return false;
+            value |= insn.operands[2];
+            return true;
+
+        case PPC_INST_MR:
+            return ResolveConstant(insn.operands[1], def, value);
         }
-        else if (table.type == SWITCH_SHORTOFFSET)
+
+        return false;
+    }
+
+    // Resolves a register to another register shifted left by the given amount, which is the switch index.
+    bool ResolveIndex(uint32_t r, size_t from, uint32_t shift, uint32_t& index, size_t& at) const
+    {
+        if (shift == 0)
         {
-            const auto* offsets = (be<uint16_t>*)image.Find(pOffset);
-            uint32_t base;
+            index = r;
+            at = from;
+            return true;
+        }
 
-            ppc::Disassemble(code + 4, table.base + 0x10, insn);
-            base = insn.operands[1] << 16;
+        const size_t def = FindDefinition(r, from);
+        if (def == -1)
+            return false;
 
-            ppc::Disassemble(code + 5, table.base + 0x14, insn);
-            base += insn.operands[2];
+        const auto& insn = insns[def];
+        if (insn.opcode->id != PPC_INST_RLWINM || insn.operands[2] != shift || insn.operands[3] != 0 || insn.operands[4] != 31 - shift)
+            return false;
+
+        index = insn.operands[1];
+        at = def;
+        return true;
+    }
+
+    // Resolves an indexed load whose operands are the table address and the switch index, in any order.
+    bool ResolveLoad(uint32_t r, size_t from, uint32_t id, uint32_t shift, SwitchTable& table, uint32_t& index, size_t& at) const
+    {
+        const size_t def = FindDefinition(r, from);
+        if (def == -1 || insns[def].opcode->id != id)
+            return false;
 
-            for (size_t i = 0; i < table.labels.size(); i++)
+        const auto& insn = insns[def];
+        for (size_t i = 0; i < 2; i++)
+        {
+            uint32_t tableAddress;
+            if (ResolveConstant(insn.operands[1 + i], def, tableAddress) && ResolveIndex(insn.operands[2 - i], def, shift, index, at))
             {
-                table.labels[i] = base + offsets[i];
+                table.tableAddress = tableAddress;
+                return true;
             }
         }
+
+        return false;
     }
-    else
+
+    // Resolves the value that gets added to the label base for relative tables.
+    bool ResolveOffset(uint32_t r, size_t from, SwitchTable& table, uint32_t& index, size_t& at) const
     {
-        assert(false);
+        if (ResolveLoad(r, from, PPC_INST_LBZX, 0, table, index, at))
+        {
+            table.type = SWITCH_BYTEOFFSET;
+            return true;
+        }
+
+        if (ResolveLoad(r, from, PPC_INST_LHZX, 1, table, index, at))
+        {
+            table.type = SWITCH_SHORTOFFSET;
+            return true;
+        }
+
+        const size_t def = FindDefinition(r, from);
+        if (def == -1)
+            return false;
+
+        const auto& insn = insns[def];
+        if (insn.opcode->id == PPC_INST_RLWINM && insn.operands[3] == 0 && insn.operands[4] == 31 - insn.operands[2] &&
+            ResolveLoad(insn.operands[1], def, PPC_INST_LBZX, 0, table, index, at))
+        {
+            table.type = SWITCH_COMPUTED;
+            table.shift = insn.operands[2];
+            return true;
+        }
+
+        return false;
     }
-}
 
-void ScanTable(const uint32_t* code, size_t base, SwitchTable& table)
-{
-    ppc_insn insn;
-    uint32_t cr{ (uint32_t)-1 };
-    for (int i = 0; i < 32; i++)
+    bool Resolve(size_t base, SwitchTable& table) const
     {
-        ppc::Disassemble(&code[-i], base - (4 * i), insn);
-        if (insn.opcode == nullptr)
+        // Find where the count register comes from.
+        size_t mtctr = -1;
+        for (size_t i = 1; i < insns.size() && mtctr == -1; i++)
         {
-            continue;
+            if (insns[i].opcode->id == PPC_INST_MTCTR)
+                mtctr = i;
         }
 
-        if (cr == -1 && (insn.opcode->id == PPC_INST_BGT || insn.opcode->id == PPC_INST_BGTLR || insn.opcode->id == PPC_INST_BLE || insn.opcode->id == PPC_INST_BLELR))
+        if (mtctr == -1)
+            return false;
+
+        const uint32_t target = insns[mtctr].operands[0];
+        const size_t def = FindDefinition(target, mtctr);
+        if (def == -1)
+            return false;
+
+        uint32_t index;
+        size_t at;
+
+        const auto& insn = insns[def];
+        if (ResolveLoad(target, mtctr, PPC_INST_LWZX, 2, table, index, at))
+        {
+            table.type = SWITCH_ABSOLUTE;
+        }
+        else if (insn.opcode->id == PPC_INST_ADD)
         {
-            cr = insn.operands[0];
-            if (insn.opcode->operands[1] != 0)
+            bool resolved = false;
+            for (size_t i = 0; i < 2 && !resolved; i++)
             {
-                table.defaultLabel = insn.operands[1];
+                uint32_t labelBase;
+                if (ResolveConstant(insn.operands[1 + i], def, labelBase) && ResolveOffset(insn.operands[2 - i], def, table, index, at))
+                {
+                    table.labelBase = labelBase;
+                    resolved = true;
+                }
             }
+
+            if (!resolved)
+                return false;
         }
-        else if (cr != -1)
+        else
         {
-            if (insn.opcode->id == PPC_INST_CMPLWI && insn.operands[0] == cr)
+            return false;
+        }
+
+        // Find the bounds check. The conditional branch tells which condition register field holds it.
+        uint32_t cr = -1;
+        for (size_t i = 1; i < insns.size(); i++)
+        {
+            const auto& insn = insns[i];
+            if (cr == -1)
             {
-                table.r = insn.operands[1];
+                if (insn.opcode->id == PPC_INST_BGT || insn.opcode->id == PPC_INST_BGTLR || insn.opcode->id == PPC_INST_BLE || insn.opcode->id == PPC_INST_BLELR)
+                {
+                    cr = insn.operands[0];
+                    if (insn.opcode->operands[1] != 0)
+                    {
+                        table.defaultLabel = insn.operands[1];
+                    }
+                }
+            }
+            else if (insn.opcode->id == PPC_INST_CMPLWI && insn.operands[0] == cr)
+            {
+                // The compared register must hold the index the table was loaded with,
+                // and still hold it at the bctr as that is what the recompiler switches on.
+                const uint32_t r = insn.operands[1];
+                if (r != index || FindDefinition(r, 0) <= std::max(i, at))
+                    return false;
+
+                table.r = r;
                 table.labels.resize(insn.operands[2] + 1);
                 table.base = base;
-                break;
+                return true;
             }
         }
+
+        return false;
     }
-}
+};
 
 void MakeMask(const uint32_t* instructions, size_t count)
 {
@@ -144,34 +374,6 @@ void MakeMask(const uint32_t* instructions, size_t count)
     }
 }
 
-void* SearchMask(const void* source, const uint32_t* compare, size_t compareCount, size_t size)
-{
-    assert(size % 4 == 0);
-    uint32_t* src = (uint32_t*)source;
-    size_t count = size / 4;
-    ppc_insn insn;
-
-    for (size_t i = 0; i < count; i++)
-    {
-        size_t c = 0;
-        for (c = 0; c < compareCount; c++)
-        {
-            ppc::Disassemble(&src[i + c], 0, insn);
-            if (insn.opcode == nullptr || insn.opcode->id != compare[c])
-            {
-                break;
-            }
-        }
-
-        if (c == compareCount)
-        {
-            return &src[i];
-        }
-    }
-
-    return nullptr;
-}
-
 static std::string out;
 
 template<class... Args>
@@ -189,8 +391,17 @@ int main(int argc, char** argv)
         return EXIT_SUCCESS;
     }
 
-    const auto file = LoadFile(argv[1]);
-    auto image = Image::ParseImage(file.data(), file.size());
+    MemoryMappedFile file(argv[1]);
+    if (!file.isOpen())
+        return EXIT_FAILURE;
+
+    // Only the code sections and the jump tables get read, so the rest of the image is never decoded.
+    auto image = Image::ParseImage(file.data(), file.size(), true);
+    if (image.data == nullptr)
+    {
+        fmt::println("ERROR: Unable to load the XEX file");
+        return EXIT_FAILURE;
+    }
 
     auto printTable = [&](const SwitchTable& table)
         {
@@ -212,98 +423,63 @@ int main(int argc, char** argv)
 
     println("# Generated by XenonAnalyse");
 
-    auto scanPattern = [&](uint32_t* pattern, size_t count, size_t type)
-        {
-            for (const auto& section : image.sections)
-            {
-                if (!(section.flags & SectionFlags_Code))
-                {
-                    continue;
-                }
-
-                size_t base = section.base;
-                uint8_t* data = section.data;
-                uint8_t* dataStart = section.data;
-                uint8_t* dataEnd = section.data + section.size;
-                while (data < dataEnd && data != nullptr)
-                {
-                    data = (uint8_t*)SearchMask(data, pattern, count, dataEnd - data);
-
-                    if (data != nullptr)
-                    {
-                        SwitchTable table{};
-                        table.type = type;
-                        ScanTable((uint32_t*)data, base + (data - dataStart), table);
-
-                        // fmt::println("{:X} ; jmptable - {}", base + (data - dataStart), table.labels.size());
-                        if (table.base != 0)
-                        {
-                            ReadTable(image, table);
-                            printTable(table);
-                            switches.emplace_back(std::move(table));
-                        }
-
-                        data += 4;
-                    }
-                    continue;
-                }
-            }
-        };
-
-    uint32_t absoluteSwitch[] =
+    // Only bctr needs to be found in the first pass, which is a plain word comparison and needs no disassembly.
+    // Instructions are disassembled afterwards, once per slice, which only covers the code leading up to a bctr.
+    struct Site
     {
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_RLWINM,
-        PPC_INST_LWZX,
-        PPC_INST_MTCTR,
-        PPC_INST_BCTR,
+        const uint32_t* code;
+        size_t base;
+        size_t maxDistance;
     };
 
-    uint32_t computedSwitch[] =
-    {
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_LBZX,
-        PPC_INST_RLWINM,
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_ADD,
-        PPC_INST_MTCTR,
-    };
+    constexpr uint32_t c_bctr = 0x4E800420;
+    constexpr size_t CHUNK_SIZE = 0x10000;
+    std::vector<Site> sites;
 
-    uint32_t offsetSwitch[] =
+    for (const auto& section : image.sections)
     {
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_LBZX,
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_ADD,
-        PPC_INST_MTCTR,
-    };
+        if (!(section.flags & SectionFlags_Code))
+        {
+            continue;
+        }
 
-    uint32_t wordOffsetSwitch[] =
-    {
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_RLWINM,
-        PPC_INST_LHZX,
-        PPC_INST_LIS,
-        PPC_INST_ADDI,
-        PPC_INST_ADD,
-        PPC_INST_MTCTR,
-    };
+        const auto* code = (const uint32_t*)section.data;
+        const size_t count = section.size / sizeof(uint32_t);
+        std::vector<std::vector<Site>> chunkSites((count + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+        ParallelFor(chunkSites.size(), 1, [&](size_t chunkIndex)
+            {
+                const size_t end = std::min((chunkIndex + 1) * CHUNK_SIZE, count);
+                for (size_t i = chunkIndex * CHUNK_SIZE; i < end; i++)
+                {
+                    if (ByteSwap(code[i]) == c_bctr)
+                        chunkSites[chunkIndex].push_back({ &code[i], section.base + i * sizeof(uint32_t), i });
+                }
+            });
 
-    println("# ---- ABSOLUTE JUMPTABLE ----");
-    scanPattern(absoluteSwitch, std::size(absoluteSwitch), SWITCH_ABSOLUTE);
+        for (auto& chunk : chunkSites)
+            sites.insert(sites.end(), chunk.begin(), chunk.end());
+    }
+
+    std::vector<SwitchTable> tables(sites.size());
+    ParallelFor(sites.size(), 16, [&](size_t i)
+        {
+            SwitchSlicer slicer(sites[i].code, sites[i].base, sites[i].maxDistance);
+            // Tables that can't be read are dropped, which leaves them out of the output.
+            if (slicer.Resolve(sites[i].base, tables[i]) && !ReadTable(image, tables[i]))
+                tables[i] = {};
+        });
 
-    println("# ---- COMPUTED JUMPTABLE ----");
-    scanPattern(computedSwitch, std::size(computedSwitch), SWITCH_COMPUTED);
+    for (auto& table : tables)
+    {
+        if (table.base != 0)
+        {
+            printTable(table);
+            switches.emplace_back(std::move(table));
+        }
+    }
 
-    println("# ---- OFFSETED JUMPTABLE ----");
-    scanPattern(offsetSwitch, std::size(offsetSwitch), SWITCH_BYTEOFFSET);
-    scanPattern(wordOffsetSwitch, std::size(wordOffsetSwitch), SWITCH_SHORTOFFSET);
+    fmt::println("Resolved {} jump tables out of {} bctr instructions", switches.size(), sites.size());
 
     std::ofstream f(argv[2]);
     f.write(out.data(), out.size());
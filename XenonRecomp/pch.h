@@ -9,6 +9,7 @@
 #include <filesystem>
 #include <fstream>
 #include <function.h>
+#include <future>
 #include <image.h>
 #include <toml++/toml.hpp>
 #include <unordered_map>
@@ -1,5 +1,7 @@
 #include "pch.h"
 #include "recompiler.h"
+#include <memory_mapped_file.h>
+#include <parallel.h>
 #include <xex_patcher.h>
 
 static uint64_t ComputeMask(uint32_t mstart, uint32_t mstop)
@@ -10,91 +12,561 @@ static uint64_t ComputeMask(uint32_t mstart, uint32_t mstop)
     return mstart <= mstop ? value : ~value;
 }
 
+enum class AtomicRmwOp
+{
+    None,
+    Exchange,
+    Or,
+    And,
+    AndC,
+    Xor
+};
+
+struct AtomicRmw
+{
+    AtomicRmwOp op = AtomicRmwOp::None;
+    uint32_t source{};
+    uint32_t storeAddress{};
+};
+
+// Recognizes reservation loops that are equivalent to a single host atomic operation:
+//   lwarx rD, rA, rB
+//   [or/and/andc/xor rD, rD, rS]
+//   stwcx. rD/rS, rA, rB
+//   bne cr0, <lwarx>
+// Arithmetic loops are left alone as carries don't propagate correctly through byteswapped memory.
+static AtomicRmw MatchAtomicRmw(const Function& fn, uint32_t address, const uint32_t* data)
+{
+    AtomicRmw result;
+    if (address < fn.base)
+        return result;
+
+    auto disassemble = [&](size_t index, ppc_insn& insn)
+        {
+            uint32_t insnAddress = address + index * 4;
+            if (insnAddress >= fn.base + fn.size)
+                return false;
+
+            ppc::Disassemble(data + index, 4, insnAddress, insn);
+            return insn.opcode != nullptr;
+        };
+
+    ppc_insn load;
+    if (!disassemble(0, load) || (load.opcode->id != PPC_INST_LWARX && load.opcode->id != PPC_INST_LDARX))
+        return result;
+
+    const uint32_t storeId = load.opcode->id == PPC_INST_LWARX ? PPC_INST_STWCX : PPC_INST_STDCX;
+    const uint32_t dest = load.operands[0];
+    if (dest == load.operands[1] || dest == load.operands[2])
+        return result;
+
+    ppc_insn insn;
+    if (!disassemble(1, insn))
+        return result;
+
+    AtomicRmwOp op = AtomicRmwOp::Exchange;
+    uint32_t source = 0;
+    size_t storeIndex = 1;
+
+    if (insn.opcode->id != storeId)
+    {
+        if (strchr(insn.opcode->name, '.') || insn.operands[0] != dest)
+            return result;
+
+        switch (insn.opcode->id)
+        {
+        case PPC_INST_OR:
+            op = AtomicRmwOp::Or;
+            break;
+        case PPC_INST_AND:
+            op = AtomicRmwOp::And;
+            break;
+        case PPC_INST_ANDC:
+            op = AtomicRmwOp::AndC;
+            break;
+        case PPC_INST_XOR:
+            op = AtomicRmwOp::Xor;
+            break;
+        default:
+            return result;
+        }
+
+        if (insn.operands[1] == dest)
+            source = insn.operands[2];
+        else if (insn.operands[2] == dest && op != AtomicRmwOp::AndC)
+            source = insn.operands[1];
+        else
+            return result;
+
+        if (source == dest)
+            return result;
+
+        storeIndex = 2;
+        if (!disassemble(storeIndex, insn) || insn.opcode->id != storeId || insn.operands[0] != dest)
+            return result;
+    }
+    else
+    {
+        source = insn.operands[0];
+        if (source == dest)
+            return result;
+    }
+
+    if (insn.operands[1] != load.operands[1] || insn.operands[2] != load.operands[2])
+        return result;
+
+    ppc_insn branch;
+    if (!disassemble(storeIndex + 1, branch) || branch.opcode->id != PPC_INST_BNE ||
+        branch.operands[0] != 0 || branch.operands[1] != address)
+    {
+        return result;
+    }
+
+    result.op = op;
+    result.source = source;
+    result.storeAddress = address + storeIndex * 4;
+    return result;
+}
+
 bool Recompiler::LoadConfig(const std::string_view& configFilePath)
 {
     config.Load(configFilePath);
 
-    std::vector<uint8_t> file;
-    if (!config.patchedFilePath.empty())
-        file = LoadFile((config.directoryPath + config.patchedFilePath).c_str());
+    const auto configFile = LoadFile(configFilePath);
+    configHash = XXH3_64bits(configFile.data(), configFile.size());
 
-    if (file.empty())
+    // The XEX file is mapped rather than read into memory, only a freshly patched file needs a buffer of its own.
+    MemoryMappedFile xexFile;
+    MemoryMappedFile reusedFile;
+    std::vector<uint8_t> patchedFile;
+
+    if (!xexFile.open(config.directoryPath + config.filePath))
     {
-        file = LoadFile((config.directoryPath + config.filePath).c_str());
+        fmt::println("ERROR: Unable to load the XEX file");
+        return false;
+    }
 
-        if (!config.patchFilePath.empty())
+    // XXH3 hashes of the XEX file and the patch file that produced the patched file, stored next to it.
+    uint64_t patchHashes[2]{};
+
+    if (!config.patchFilePath.empty())
+    {
+        MemoryMappedFile patchFile(config.directoryPath + config.patchFilePath);
+        if (!patchFile.isOpen())
         {
-            const auto patchFile = LoadFile((config.directoryPath + config.patchFilePath).c_str());
-            if (!patchFile.empty())
+            fmt::println("ERROR: Unable to load the patch file");
+            return false;
+        }
+
+        patchHashes[0] = XXH3_64bits(xexFile.data(), xexFile.size());
+        patchHashes[1] = XXH3_64bits(patchFile.data(), patchFile.size());
+
+        // An existing patched file is only reused if it was made from this exact XEX and patch.
+        if (!config.patchedFilePath.empty())
+        {
+            const auto storedHashes = LoadFile(config.directoryPath + config.patchedFilePath + ".hash");
+            if (storedHashes.size() == sizeof(patchHashes) && memcmp(storedHashes.data(), patchHashes, sizeof(patchHashes)) == 0 &&
+                std::filesystem::exists(config.directoryPath + config.patchedFilePath))
             {
-                std::vector<uint8_t> outBytes;
-                auto result = XexPatcher::apply(file.data(), file.size(), patchFile.data(), patchFile.size(), outBytes, false);
-                if (result == XexPatcher::Result::Success)
+                reusedFile.open(config.directoryPath + config.patchedFilePath);
+            }
+        }
+
+        if (!reusedFile.isOpen())
+        {
+            auto result = XexPatcher::apply(xexFile.data(), xexFile.size(), patchFile.data(), patchFile.size(), patchedFile, false);
+            if (result != XexPatcher::Result::Success)
+            {
+                fmt::print("ERROR: Unable to apply the patch file, ");
+
+                switch (result)
                 {
-                    std::exchange(file, outBytes);
+                case XexPatcher::Result::XexFileUnsupported:
+                    fmt::println("XEX file unsupported");
+                    break;
 
-                    if (!config.patchedFilePath.empty())
+                case XexPatcher::Result::XexFileInvalid:
+                    fmt::println("XEX file invalid");
+                    break;
+
+                case XexPatcher::Result::PatchFileInvalid:
+                    fmt::println("patch file invalid");
+                    break;
+
+                case XexPatcher::Result::PatchIncompatible:
+                    fmt::println("patch file incompatible");
+                    break;
+
+                case XexPatcher::Result::PatchFailed:
+                    fmt::println("patch failed");
+                    break;
+
+                case XexPatcher::Result::PatchUnsupported:
+                    fmt::println("patch unsupported");
+                    break;
+
+                default:
+                    fmt::println("reason unknown");
+                    break;
+                }
+
+                return false;
+            }
+        }
+    }
+
+    const uint8_t* fileData = xexFile.data();
+    size_t fileSize = xexFile.size();
+
+    if (reusedFile.isOpen())
+    {
+        fileData = reusedFile.data();
+        fileSize = reusedFile.size();
+    }
+    else if (!patchedFile.empty())
+    {
+        fileData = patchedFile.data();
+        fileSize = patchedFile.size();
+    }
+
+    imageHash = XXH3_64bits(fileData, fileSize);
+    image = Image::ParseImage(fileData, fileSize);
+    if (image.data == nullptr)
+    {
+        fmt::println("ERROR: Unable to parse the XEX file");
+        return false;
+    }
+
+    // The image owns a copy of the data, so the patched file can be written in the background while the image is analysed.
+    // Files are written to a temporary file first, an interrupted write must not leave a truncated file behind to be reused.
+    // The hashes are removed before the patched file is replaced and written after it, so they never vouch for the wrong file.
+    if (!patchedFile.empty() && !config.patchedFilePath.empty())
+    {
+        patchedFileWrite = std::async(std::launch::async, [path = std::filesystem::path(config.directoryPath + config.patchedFilePath), bytes = std::move(patchedFile), patchHashes]()
+            {
+                auto writeFile = [](const std::filesystem::path& filePath, const void* data, size_t size)
                     {
-                        std::ofstream stream(config.directoryPath + config.patchedFilePath, std::ios::binary);
+                        std::filesystem::path tempPath = filePath;
+                        tempPath += ".tmp";
+
+                        std::ofstream stream(tempPath, std::ios::binary);
+                        if (!stream.good())
+                            return false;
+
+                        stream.write(reinterpret_cast<const char*>(data), size);
+                        stream.close();
+
+                        std::error_code ec;
                         if (stream.good())
+                            std::filesystem::rename(tempPath, filePath, ec);
+
+                        if (!stream.good() || ec)
                         {
-                            stream.write(reinterpret_cast<const char*>(file.data()), file.size());
-                            stream.close();
+                            std::filesystem::remove(tempPath, ec);
+                            return false;
                         }
-                    }
-                }
-                else
-                {
-                    fmt::print("ERROR: Unable to apply the patch file, ");
 
-                    switch (result)
-                    {
-                    case XexPatcher::Result::XexFileUnsupported:
-                        fmt::println("XEX file unsupported");
-                        break;
+                        return true;
+                    };
 
-                    case XexPatcher::Result::XexFileInvalid:
-                        fmt::println("XEX file invalid");
-                        break;
+                std::filesystem::path hashPath = path;
+                hashPath += ".hash";
 
-                    case XexPatcher::Result::PatchFileInvalid:
-                        fmt::println("patch file invalid");
-                        break;
+                std::error_code ec;
+                std::filesystem::remove(hashPath, ec);
 
-                    case XexPatcher::Result::PatchIncompatible:
-                        fmt::println("patch file incompatible");
-                        break;
+                if (writeFile(path, bytes.data(), bytes.size()))
+                    writeFile(hashPath, patchHashes, sizeof(patchHashes));
+            });
+    }
 
-                    case XexPatcher::Result::PatchFailed:
-                        fmt::println("patch failed");
-                        break;
+    DetectRegisterHelpers();
 
-                    case XexPatcher::Result::PatchUnsupported:
-                        fmt::println("patch unsupported");
-                        break;
+    if (config.restGpr14Address == 0) fmt::println("ERROR: __restgprlr_14 address is unspecified");
+    if (config.saveGpr14Address == 0) fmt::println("ERROR: __savegprlr_14 address is unspecified");
+    if (config.restFpr14Address == 0) fmt::println("ERROR: __restfpr_14 address is unspecified");
+    if (config.saveFpr14Address == 0) fmt::println("ERROR: __savefpr_14 address is unspecified");
+    if (config.restVmx14Address == 0) fmt::println("ERROR: __restvmx_14 address is unspecified");
+    if (config.saveVmx14Address == 0) fmt::println("ERROR: __savevmx_14 address is unspecified");
+    if (config.restVmx64Address == 0) fmt::println("ERROR: __restvmx_64 address is unspecified");
+    if (config.saveVmx64Address == 0) fmt::println("ERROR: __savevmx_64 address is unspecified");
 
-                    default:
-                        fmt::println("reason unknown");
-                        break;
-                    }
+    return true;
+}
+
+void Recompiler::DetectRegisterHelpers()
+{
+    struct RegisterHelperPattern
+    {
+        const char* name;
+        uint32_t* address;
+        std::vector<uint32_t> words;
+    };
 
-                    return false;
+    RegisterHelperPattern patterns[] =
+    {
+        { "__restgprlr_14", &config.restGpr14Address },
+        { "__savegprlr_14", &config.saveGpr14Address },
+        { "__restfpr_14", &config.restFpr14Address },
+        { "__savefpr_14", &config.saveFpr14Address },
+        { "__restvmx_14", &config.restVmx14Address },
+        { "__savevmx_14", &config.saveVmx14Address },
+        { "__restvmx_64", &config.restVmx64Address },
+        { "__savevmx_64", &config.saveVmx64Address },
+    };
+
+    // The whole body of each helper is matched, as functions with inlined prologues and epilogues share the first instructions.
+    for (uint32_t i = 14; i < 32; i++)
+    {
+        uint32_t gprOffset = uint16_t(-0x98 + (i - 14) * 8);
+        patterns[0].words.push_back(0xE8010000 | (i << 21) | gprOffset); // ld ri, offset(r1)
+        patterns[1].words.push_back(0xF8010000 | (i << 21) | gprOffset); // std ri, offset(r1)
+
+        uint32_t fprOffset = uint16_t(-0x90 + (i - 14) * 8);
+        patterns[2].words.push_back(0xC80C0000 | (i << 21) | fprOffset); // lfd fi, offset(r12)
+        patterns[3].words.push_back(0xD80C0000 | (i << 21) | fprOffset); // stfd fi, offset(r12)
+
+        uint32_t li = 0x39600000 | uint16_t(-0x120 + (i - 14) * 16); // li r11, offset
+        patterns[4].words.insert(patterns[4].words.end(), { li, 0x7C0B60CE | (i << 21) }); // lvx vi, r11, r12
+        patterns[5].words.insert(patterns[5].words.end(), { li, 0x7C0B61CE | (i << 21) }); // stvx vi, r11, r12
+    }
+
+    for (uint32_t i = 64; i < 128; i++)
+    {
+        uint32_t li = 0x39600000 | uint16_t(-0x400 + (i - 64) * 16); // li r11, offset
+        uint32_t vr = ((i & 0x1F) << 21) | ((i >> 5) << 2);
+        patterns[6].words.insert(patterns[6].words.end(), { li, 0x100B60C3 | vr }); // lvx128 vi, r11, r12
+        patterns[7].words.insert(patterns[7].words.end(), { li, 0x100B61C3 | vr }); // stvx128 vi, r11, r12
+    }
+
+    patterns[0].words.insert(patterns[0].words.end(), { 0x8181FFF8, 0x7D8803A6 }); // lwz r12, -0x8(r1); mtlr r12
+    patterns[1].words.push_back(0x9181FFF8); // stw r12, -0x8(r1)
+
+    for (auto& pattern : patterns)
+        pattern.words.push_back(0x4E800020); // blr
+
+    for (const auto& section : image.sections)
+    {
+        if (!(section.flags & SectionFlags_Code) || section.data == nullptr)
+            continue;
+
+        auto* data = reinterpret_cast<const uint32_t*>(section.data);
+        size_t count = section.size / sizeof(uint32_t);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t word = ByteSwap(data[i]);
+
+            for (auto& pattern : patterns)
+            {
+                if (*pattern.address != 0 || word != pattern.words[0] || count - i < pattern.words.size())
+                    continue;
+
+                size_t j = 1;
+                while (j < pattern.words.size() && ByteSwap(data[i + j]) == pattern.words[j])
+                    j++;
+
+                if (j == pattern.words.size())
+                {
+                    *pattern.address = section.base + i * sizeof(uint32_t);
+                    fmt::println("Detected {} at 0x{:X}", pattern.name, *pattern.address);
                 }
             }
-            else
-            {
-                fmt::println("ERROR: Unable to load the patch file");
+        }
+    }
+}
+
+// Bump the version whenever the analysis results or the layout of the cache change.
+static constexpr uint32_t c_analysisCacheMagic = 0x43415258; // XRAC
+static constexpr uint32_t c_analysisCacheVersion = 1;
+
+struct AnalysisCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t imageHash;
+    uint64_t configHash;
+    uint32_t functionCount;
+    uint32_t symbolCount;
+};
+
+struct AnalysisCacheFunction
+{
+    uint32_t base;
+    uint32_t size;
+    uint32_t blockCount;
+};
+
+struct AnalysisCacheBlock
+{
+    uint32_t base;
+    uint32_t size;
+};
+
+struct AnalysisCacheSymbol
+{
+    uint32_t address;
+    uint32_t size;
+    uint32_t type;
+    uint32_t nameLength;
+};
+
+bool Recompiler::LoadAnalysisCache()
+{
+    if (config.analysisCacheFilePath.empty())
+        return false;
+
+    const auto path = config.directoryPath + config.analysisCacheFilePath;
+    if (!std::filesystem::exists(path))
+        return false;
+
+    MemoryMappedFile file(path);
+    if (!file.isOpen())
+        return false;
+
+    const uint8_t* cursor = file.data();
+    const uint8_t* end = file.data() + file.size();
+
+    auto read = [&](void* dest, size_t size)
+        {
+            if (size_t(end - cursor) < size)
                 return false;
-            }
+
+            memcpy(dest, cursor, size);
+            cursor += size;
+            return true;
+        };
+
+    // Counts are checked against the remaining bytes before anything is allocated for them,
+    // so a corrupted cache is rejected instead of requesting an enormous allocation.
+    auto fits = [&](size_t count, size_t elementSize)
+        {
+            return count <= size_t(end - cursor) / elementSize;
+        };
+
+    AnalysisCacheHeader header;
+    if (!read(&header, sizeof(header)) || header.magic != c_analysisCacheMagic || header.version != c_analysisCacheVersion ||
+        header.imageHash != imageHash || header.configHash != configHash)
+    {
+        return false;
+    }
+
+    if (!fits(header.functionCount, sizeof(AnalysisCacheFunction)))
+        return false;
+
+    std::vector<Function> cachedFunctions(header.functionCount);
+    for (auto& fn : cachedFunctions)
+    {
+        AnalysisCacheFunction cachedFunction;
+        if (!read(&cachedFunction, sizeof(cachedFunction)) || !fits(cachedFunction.blockCount, sizeof(AnalysisCacheBlock)))
+            return false;
+
+        fn.base = cachedFunction.base;
+        fn.size = cachedFunction.size;
+        fn.blocks.resize(cachedFunction.blockCount);
+
+        for (auto& block : fn.blocks)
+        {
+            AnalysisCacheBlock cachedBlock;
+            if (!read(&cachedBlock, sizeof(cachedBlock)))
+                return false;
+
+            block.base = cachedBlock.base;
+            block.size = cachedBlock.size;
         }
     }
 
-    image = Image::ParseImage(file.data(), file.size());
+    if (!fits(header.symbolCount, sizeof(AnalysisCacheSymbol)))
+        return false;
+
+    SymbolTable cachedSymbols;
+    cachedSymbols.reserve(header.symbolCount);
+    for (size_t i = 0; i < header.symbolCount; i++)
+    {
+        AnalysisCacheSymbol cachedSymbol;
+        if (!read(&cachedSymbol, sizeof(cachedSymbol)) || size_t(end - cursor) < cachedSymbol.nameLength)
+            return false;
+
+        std::string name(reinterpret_cast<const char*>(cursor), cachedSymbol.nameLength);
+        cursor += cachedSymbol.nameLength;
+
+        cachedSymbols.emplace(std::move(name), cachedSymbol.address, cachedSymbol.size, SymbolType(cachedSymbol.type));
+    }
+
+    functions = std::move(cachedFunctions);
+    image.symbols = std::move(cachedSymbols);
+
+    fmt::println("Loaded analysis results from {}", config.analysisCacheFilePath);
     return true;
 }
 
+void Recompiler::SaveAnalysisCache() const
+{
+    if (config.analysisCacheFilePath.empty())
+        return;
+
+    // Like the patched file, the cache is written to a temporary file and renamed into place once complete.
+    const std::filesystem::path path = config.directoryPath + config.analysisCacheFilePath;
+    std::filesystem::path tempPath = path;
+    tempPath += ".tmp";
+
+    std::ofstream stream(tempPath, std::ios::binary);
+    if (!stream.good())
+    {
+        fmt::println("ERROR: Unable to write the analysis cache file");
+        return;
+    }
+
+    auto write = [&](const void* data, size_t size)
+        {
+            stream.write(reinterpret_cast<const char*>(data), size);
+        };
+
+    AnalysisCacheHeader header{ c_analysisCacheMagic, c_analysisCacheVersion, imageHash, configHash, uint32_t(functions.size()), uint32_t(image.symbols.size()) };
+    write(&header, sizeof(header));
+
+    for (const auto& fn : functions)
+    {
+        AnalysisCacheFunction cachedFunction{ uint32_t(fn.base), uint32_t(fn.size), uint32_t(fn.blocks.size()) };
+        write(&cachedFunction, sizeof(cachedFunction));
+
+        for (const auto& block : fn.blocks)
+        {
+            AnalysisCacheBlock cachedBlock{ uint32_t(block.base), uint32_t(block.size) };
+            write(&cachedBlock, sizeof(cachedBlock));
+        }
+    }
+
+    for (const auto& symbol : image.symbols)
+    {
+        AnalysisCacheSymbol cachedSymbol{ uint32_t(symbol.address), uint32_t(symbol.size), uint32_t(symbol.type), uint32_t(symbol.name.size()) };
+        write(&cachedSymbol, sizeof(cachedSymbol));
+        write(symbol.name.data(), symbol.name.size());
+    }
+
+    stream.close();
+
+    std::error_code ec;
+    if (stream.good())
+        std::filesystem::rename(tempPath, path, ec);
+
+    if (!stream.good() || ec)
+    {
+        std::filesystem::remove(tempPath, ec);
+        fmt::println("ERROR: Unable to write the analysis cache file");
+    }
+}
+
 void Recompiler::Analyse()
 {
+    if (LoadAnalysisCache())
+    {
+        BuildCallGraph();
+        return;
+    }
+
+    std::unordered_set<size_t> gapFunctions;
+
     for (size_t i = 14; i < 128; i++)
     {
         if (i < 32)
@@ -148,110 +620,648 @@ void Recompiler::Analyse()
             }
         }
 
-        if (i >= 64)
+        if (i >= 64)
+        {
+            if (config.restVmx64Address != 0)
+            {
+                auto& restvmx = functions.emplace_back();
+                restvmx.base = config.restVmx64Address + (i - 64) * 8;
+                restvmx.size = (128 - i) * 8 + 4;
+                image.symbols.emplace(fmt::format("__restvmx_{}", i), restvmx.base, restvmx.size, Symbol_Function);
+            }
+
+            if (config.saveVmx64Address != 0)
+            {
+                auto& savevmx = functions.emplace_back();
+                savevmx.base = config.saveVmx64Address + (i - 64) * 8;
+                savevmx.size = (128 - i) * 8 + 4;
+                image.symbols.emplace(fmt::format("__savevmx_{}", i), savevmx.base, savevmx.size, Symbol_Function);
+            }
+        }
+    }
+
+    for (auto& [address, size] : config.functions)
+    {
+        functions.emplace_back(address, size);
+        image.symbols.emplace(address, size, Symbol_Function);
+    }
+
+    const auto* pdata = image.Find(".pdata");
+    size_t count = pdata != nullptr ? pdata->size / sizeof(IMAGE_CE_RUNTIME_FUNCTION) : 0;
+    auto* pf = pdata != nullptr ? (IMAGE_CE_RUNTIME_FUNCTION*)pdata->data : nullptr;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto fn = pf[i];
+        fn.BeginAddress = ByteSwap(fn.BeginAddress);
+        fn.Data = ByteSwap(fn.Data);
+
+        if (image.symbols.find(fn.BeginAddress) == image.symbols.end())
+        {
+            auto& f = functions.emplace_back();
+            f.base = fn.BeginAddress;
+            f.size = fn.FunctionLength * 4;
+
+            image.symbols.emplace(f.base, f.size, Symbol_Function);
+        }
+    }
+
+    for (const auto& section : image.sections)
+    {
+        if (!(section.flags & SectionFlags_Code))
+        {
+            continue;
+        }
+        size_t base = section.base;
+        uint8_t* data = section.data;
+        uint8_t* dataEnd = section.data + section.size;
+
+        // Collect call targets in parallel chunks, then analyse every new target concurrently.
+        // Symbols are only read while the threads run, and are merged afterwards in address order.
+        constexpr size_t CHUNK_SIZE = 0x10000;
+        const size_t wordCount = section.size / 4;
+        std::vector<std::vector<size_t>> chunkTargets((wordCount + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+        ParallelFor(chunkTargets.size(), 1, [&](size_t chunkIndex)
+            {
+                auto& targets = chunkTargets[chunkIndex];
+                const size_t end = std::min((chunkIndex + 1) * CHUNK_SIZE, wordCount);
+
+                for (size_t i = chunkIndex * CHUNK_SIZE; i < end; i++)
+                {
+                    uint32_t insn = ByteSwap(*(uint32_t*)(section.data + i * 4));
+                    if (PPC_OP(insn) == PPC_OP_B && PPC_BL(insn))
+                    {
+                        size_t address = base + i * 4 + PPC_BI(insn);
+
+                        if (address >= section.base && address < section.base + section.size && image.symbols.find(address) == image.symbols.end())
+                            targets.push_back(address);
+                    }
+                }
+            });
+
+        std::vector<size_t> targets;
+        for (auto& chunk : chunkTargets)
+            targets.insert(targets.end(), chunk.begin(), chunk.end());
+
+        std::sort(targets.begin(), targets.end());
+        targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+        std::vector<Function> targetFunctions(targets.size());
+        ParallelFor(targets.size(), 16, [&](size_t i)
+            {
+                targetFunctions[i] = Function::Analyze(section.data + targets[i] - section.base, section.base + section.size - targets[i], targets[i]);
+            });
+
+        // New symbols are added in one batch per pass, which moves the symbol table only once.
+        std::vector<Symbol> newSymbols;
+        for (auto& fn : targetFunctions)
+        {
+            newSymbols.emplace_back(fn.base, fn.size, Symbol_Function);
+            functions.emplace_back(std::move(fn));
+        }
+
+        image.symbols.insert(std::move(newSymbols));
+
+        while (data < dataEnd)
+        {
+            auto invalidInstr = config.invalidInstructions.find(ByteSwap(*(uint32_t*)data));
+            if (invalidInstr != config.invalidInstructions.end())
+            {
+                base += invalidInstr->second;
+                data += invalidInstr->second;
+                continue;
+            }
+
+            auto fnSymbol = image.symbols.find(base);
+            if (fnSymbol != image.symbols.end() && fnSymbol->address == base && fnSymbol->type == Symbol_Function)
+            {
+                assert(fnSymbol->address == base);
+
+                base += fnSymbol->size;
+                data += fnSymbol->size;
+            }
+            else
+            {
+                // The scan only moves forward, so it never needs to find the symbols it adds.
+                auto& fn = functions.emplace_back(Function::Analyze(data, dataEnd - data, base));
+                newSymbols.emplace_back(fn.base, fn.size, Symbol_Function);
+                gapFunctions.emplace(fn.base);
+
+                base += fn.size;
+                data += fn.size;
+            }
+        }
+
+        image.symbols.insert(std::move(newSymbols));
+    }
+
+    std::sort(functions.begin(), functions.end(), [](auto& lhs, auto& rhs) { return lhs.base < rhs.base; });
+
+    RefineFunctionBoundaries(gapFunctions);
+    BuildCallGraph();
+    SaveAnalysisCache();
+}
+
+void Recompiler::RefineFunctionBoundaries(const std::unordered_set<size_t>& gapFunctions)
+{
+    // Functions found while filling gaps are not called, listed in .pdata or configured, so they are often
+    // the remainder of the previous function that Function::Analyze cut short. Those are merged back into it,
+    // unless something refers to their address, in which case they may really be separate functions.
+    std::unordered_set<size_t> referenced;
+    referenced.emplace(image.entry_point);
+
+    for (auto& [address, midAsmHook] : config.midAsmHooks)
+    {
+        referenced.emplace(midAsmHook.jumpAddress);
+        referenced.emplace(midAsmHook.jumpAddressOnTrue);
+        referenced.emplace(midAsmHook.jumpAddressOnFalse);
+    }
+
+    for (const auto& section : image.sections)
+    {
+        if (section.data == nullptr || section.name == ".pdata")
+            continue;
+
+        uint32_t values[32]{};
+        for (size_t i = 0; i < section.size / 4; i++)
+        {
+            const uint32_t insn = ByteSwap(*(uint32_t*)(section.data + i * 4));
+            uint32_t value = insn;
+
+            if (section.flags & SectionFlags_Code)
+            {
+                // Address constants built with lis followed by addi or ori.
+                switch (PPC_OP(insn))
+                {
+                case PPC_OP_ADDIS:
+                    if (PPC_RA(insn) == 0)
+                        values[PPC_RD(insn)] = PPC_UIMM(insn) << 16;
+                    continue;
+
+                case PPC_OP_ADDI:
+                    if (PPC_RA(insn) == 0)
+                        continue;
+                    value = values[PPC_RA(insn)] + PPC_SIMM(insn);
+                    break;
+
+                case PPC_OP_ORI:
+                    value = values[PPC_RD(insn)] | PPC_UIMM(insn);
+                    break;
+
+                default:
+                    continue;
+                }
+            }
+
+            if (gapFunctions.find(value) != gapFunctions.end())
+                referenced.emplace(value);
+        }
+    }
+
+    // A gap function that another function tail calls with b or bc must keep its own symbol,
+    // otherwise the branch in the caller has nowhere to go once the gap function is merged away.
+    for (const auto& fn : functions)
+    {
+        auto* data = (const uint32_t*)image.Find(fn.base, fn.size);
+        if (data == nullptr)
+            continue;
+
+        for (size_t i = 0; i < fn.size / 4; i++)
+        {
+            const uint32_t insn = ByteSwap(data[i]);
+            if (PPC_BL(insn) || PPC_BA(insn))
+                continue;
+
+            size_t target;
+            if (PPC_OP(insn) == PPC_OP_B)
+                target = fn.base + i * 4 + PPC_BI(insn);
+            else if (PPC_OP(insn) == PPC_OP_BC)
+                target = fn.base + i * 4 + PPC_BD(insn);
+            else
+                continue;
+
+            if ((target < fn.base || target >= fn.base + fn.size) && gapFunctions.find(target) != gapFunctions.end())
+                referenced.emplace(target);
+        }
+    }
+
+    // Functions listed in .pdata or configured have an authoritative size, so nothing is merged into them.
+    std::unordered_set<size_t> fixedSize;
+    for (auto& [address, size] : config.functions)
+        fixedSize.emplace(address);
+
+    if (auto* pdata = image.Find(".pdata"))
+    {
+        auto* pf = (const IMAGE_CE_RUNTIME_FUNCTION*)pdata->data;
+        for (size_t i = 0; i < pdata->size / sizeof(IMAGE_CE_RUNTIME_FUNCTION); i++)
+            fixedSize.emplace(ByteSwap(pf[i].BeginAddress));
+    }
+
+    auto branchesInto = [&](const Function& fn, size_t begin, size_t end)
+        {
+            auto* data = (const uint32_t*)image.Find(fn.base, fn.size);
+            if (data == nullptr)
+                return false;
+
+            for (size_t i = 0; i < fn.size / 4; i++)
+            {
+                const uint32_t insn = ByteSwap(data[i]);
+                if (PPC_BL(insn) || PPC_BA(insn))
+                    continue;
+
+                size_t target;
+                if (PPC_OP(insn) == PPC_OP_B)
+                    target = fn.base + i * 4 + PPC_BI(insn);
+                else if (PPC_OP(insn) == PPC_OP_BC)
+                    target = fn.base + i * 4 + PPC_BD(insn);
+                else
+                    continue;
+
+                if (target >= begin && target < end)
+                    return true;
+            }
+
+            return false;
+        };
+
+    // The function merged into only grows, so its symbol is resized in place. The symbols of the functions merged away
+    // are all removed in one pass at the end, instead of moving the rest of the symbol table for each merge.
+    auto resizeSymbol = [&](size_t address, size_t size)
+        {
+            bool found = false;
+            auto [begin, end] = image.symbols.equal_range(address);
+            for (auto it = begin; it != end; ++it)
+            {
+                if (it->type == Symbol_Function)
+                {
+                    image.symbols.setSize(it, size);
+                    found = true;
+                }
+            }
+
+            if (!found)
+                image.symbols.emplace(address, size, Symbol_Function);
+        };
+
+    std::unordered_set<size_t> mergedAway;
+    size_t mergeCount = 0;
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        std::vector<Function> refined;
+        refined.reserve(functions.size());
+
+        for (auto& fn : functions)
+        {
+            if (!refined.empty())
+            {
+                auto& prev = refined.back();
+                if (prev.base + prev.size == fn.base && fn.size != 0 && fixedSize.find(prev.base) == fixedSize.end() &&
+                    gapFunctions.find(fn.base) != gapFunctions.end() && referenced.find(fn.base) == referenced.end() &&
+                    (branchesInto(prev, fn.base, fn.base + fn.size) || branchesInto(fn, prev.base + 4, prev.base + prev.size)))
+                {
+                    fmt::println("Merged sub_{:X} into sub_{:X}, size 0x{:X} -> 0x{:X}", fn.base, prev.base, prev.size, prev.size + fn.size);
+
+                    for (auto& block : fn.blocks)
+                        prev.blocks.emplace_back(block.base + fn.base - prev.base, block.size);
+
+                    prev.size += fn.size;
+                    resizeSymbol(prev.base, prev.size);
+                    mergedAway.emplace(fn.base);
+
+                    ++mergeCount;
+                    changed = true;
+                    continue;
+                }
+            }
+
+            refined.emplace_back(std::move(fn));
+        }
+
+        functions = std::move(refined);
+    }
+
+    if (!mergedAway.empty())
+    {
+        auto removed = std::remove_if(image.symbols.begin(), image.symbols.end(), [&](const Symbol& symbol)
+            {
+                return symbol.type == Symbol_Function && mergedAway.find(symbol.address) != mergedAway.end();
+            });
+
+        image.symbols.erase(removed, image.symbols.end());
+    }
+
+    if (mergeCount != 0)
+        fmt::println("Merged {} functions into the function preceding them", mergeCount);
+}
+
+size_t Recompiler::FindFunction(size_t address) const
+{
+    auto it = std::upper_bound(functions.begin(), functions.end(), address, [](size_t address, const Function& fn)
+        {
+            return address < fn.base;
+        });
+
+    if (it == functions.begin())
+        return -1;
+
+    --it;
+    if (address >= it->base + it->size)
+        return -1;
+
+    return it - functions.begin();
+}
+
+void Recompiler::BuildCallGraph()
+{
+    callGraph.clear();
+    callGraph.resize(functions.size());
+
+    ParallelFor(functions.size(), 64, [&](size_t index)
+        {
+            const auto& fn = functions[index];
+            auto& callees = callGraph[index];
+
+            auto addReference = [&](size_t address)
+                {
+                    size_t callee = FindFunction(address);
+                    if (callee != -1 && callee != index)
+                        callees.push_back(callee);
+                };
+
+            // Function pointers are built with lis followed by addi or ori.
+            // Values aren't invalidated by other writes, a stale one can only add an edge.
+            uint32_t values[32]{};
+            uint32_t validValues = 0;
+
+            auto* data = (const uint32_t*)image.Find(fn.base, fn.size);
+            if (data == nullptr)
+                return;
+
+            for (size_t i = 0; i < fn.size / 4; i++)
+            {
+                const uint32_t insn = ByteSwap(data[i]);
+                const size_t address = fn.base + i * 4;
+
+                switch (PPC_OP(insn))
+                {
+                case PPC_OP_B:
+                    if (!PPC_BA(insn))
+                        addReference(address + PPC_BI(insn));
+                    break;
+
+                case PPC_OP_BC:
+                    if (!PPC_BA(insn))
+                        addReference(address + PPC_BD(insn));
+                    break;
+
+                case PPC_OP_ADDIS:
+                    if (PPC_RA(insn) == 0)
+                    {
+                        values[PPC_RD(insn)] = PPC_UIMM(insn) << 16;
+                        validValues |= 1u << PPC_RD(insn);
+                    }
+                    break;
+
+                case PPC_OP_ADDI:
+                    if (PPC_RA(insn) != 0 && (validValues & (1u << PPC_RA(insn))) != 0)
+                    {
+                        values[PPC_RD(insn)] = values[PPC_RA(insn)] + PPC_SIMM(insn);
+                        validValues |= 1u << PPC_RD(insn);
+                        addReference(values[PPC_RD(insn)]);
+                    }
+                    break;
+
+                case PPC_OP_ORI:
+                    // rS and rA are swapped compared to addi.
+                    if ((validValues & (1u << PPC_RD(insn))) != 0)
+                    {
+                        values[PPC_RA(insn)] = values[PPC_RD(insn)] | PPC_UIMM(insn);
+                        validValues |= 1u << PPC_RA(insn);
+                        addReference(values[PPC_RA(insn)]);
+                    }
+                    break;
+                }
+            }
+
+            std::sort(callees.begin(), callees.end());
+            callees.erase(std::unique(callees.begin(), callees.end()), callees.end());
+        });
+
+    // Switch cases that land outside of their own function are tail calls.
+    for (auto& [address, switchTable] : config.switchTables)
+    {
+        size_t index = FindFunction(address);
+        if (index == -1)
+            continue;
+
+        auto& callees = callGraph[index];
+        for (auto label : switchTable.labels)
+        {
+            size_t callee = FindFunction(label);
+            if (callee != -1 && callee != index && std::find(callees.begin(), callees.end(), callee) == callees.end())
+                callees.push_back(callee);
+        }
+    }
+}
+
+void Recompiler::FindUnreachableFunctions()
+{
+    std::vector<bool> reachable(functions.size());
+    std::vector<size_t> stack;
+
+    auto addRoot = [&](size_t address)
         {
-            if (config.restVmx64Address != 0)
+            size_t index = FindFunction(address);
+            if (index != -1 && !reachable[index])
             {
-                auto& restvmx = functions.emplace_back();
-                restvmx.base = config.restVmx64Address + (i - 64) * 8;
-                restvmx.size = (128 - i) * 8 + 4;
-                image.symbols.emplace(fmt::format("__restvmx_{}", i), restvmx.base, restvmx.size, Symbol_Function);
+                reachable[index] = true;
+                stack.push_back(index);
             }
+        };
 
-            if (config.saveVmx64Address != 0)
-            {
-                auto& savevmx = functions.emplace_back();
-                savevmx.base = config.saveVmx64Address + (i - 64) * 8;
-                savevmx.size = (128 - i) * 8 + 4;
-                image.symbols.emplace(fmt::format("__savevmx_{}", i), savevmx.base, savevmx.size, Symbol_Function);
-            }
-        }
-    }
+    addRoot(image.entry_point);
 
-    for (auto& [address, size] : config.functions)
+    for (auto root : config.reachableFunctionRoots)
+        addRoot(root);
+
+    for (auto& [address, midAsmHook] : config.midAsmHooks)
     {
-        functions.emplace_back(address, size);
-        image.symbols.emplace(fmt::format("sub_{:X}", address), address, size, Symbol_Function);
+        addRoot(midAsmHook.jumpAddress);
+        addRoot(midAsmHook.jumpAddressOnTrue);
+        addRoot(midAsmHook.jumpAddressOnFalse);
     }
 
-    auto& pdata = *image.Find(".pdata");
-    size_t count = pdata.size / sizeof(IMAGE_CE_RUNTIME_FUNCTION);
-    auto* pf = (IMAGE_CE_RUNTIME_FUNCTION*)pdata.data;
-    for (size_t i = 0; i < count; i++)
+    // Any word in data sections that points to the start of a function is treated as a root,
+    // which covers vtables and other function pointer tables. .pdata refers to every function so it's skipped.
+    for (const auto& section : image.sections)
     {
-        auto fn = pf[i];
-        fn.BeginAddress = ByteSwap(fn.BeginAddress);
-        fn.Data = ByteSwap(fn.Data);
+        if ((section.flags & SectionFlags_Code) || section.data == nullptr || section.name == ".pdata")
+            continue;
 
-        if (image.symbols.find(fn.BeginAddress) == image.symbols.end())
-        {
-            auto& f = functions.emplace_back();
-            f.base = fn.BeginAddress;
-            f.size = fn.FunctionLength * 4;
+        const size_t wordCount = section.size / 4;
+        std::vector<std::vector<size_t>> chunkRoots((wordCount + 0xFFFF) / 0x10000);
+
+        ParallelFor(chunkRoots.size(), 1, [&](size_t chunkIndex)
+            {
+                const size_t end = std::min((chunkIndex + 1) * 0x10000, wordCount);
+                for (size_t i = chunkIndex * 0x10000; i < end; i++)
+                {
+                    const uint32_t value = ByteSwap(*(uint32_t*)(section.data + i * 4));
+                    size_t index = FindFunction(value);
+                    if (index != -1 && functions[index].base == value)
+                        chunkRoots[chunkIndex].push_back(index);
+                }
+            });
 
-            image.symbols.emplace(fmt::format("sub_{:X}", f.base), f.base, f.size, Symbol_Function);
+        for (auto& roots : chunkRoots)
+        {
+            for (auto index : roots)
+                addRoot(functions[index].base);
         }
     }
 
-    for (const auto& section : image.sections)
+    while (!stack.empty())
     {
-        if (!(section.flags & SectionFlags_Code))
+        size_t index = stack.back();
+        stack.pop_back();
+
+        for (auto callee : callGraph[index])
         {
-            continue;
+            if (!reachable[callee])
+            {
+                reachable[callee] = true;
+                stack.push_back(callee);
+            }
         }
-        size_t base = section.base;
-        uint8_t* data = section.data;
-        uint8_t* dataEnd = section.data + section.size;
+    }
 
-        while (data < dataEnd)
+    unreachableFunctions.clear();
+    for (size_t i = 0; i < functions.size(); i++)
+    {
+        if (!reachable[i])
+            unreachableFunctions.emplace(functions[i].base);
+    }
+
+    fmt::println("{} of {} functions are reachable", functions.size() - unreachableFunctions.size(), functions.size());
+}
+
+void Recompiler::FindFlushModePreservingFunctions()
+{
+    // Not a vector<bool>, as the elements are written from multiple threads.
+    std::vector<uint8_t> changesFlushMode(functions.size());
+
+    ParallelFor(functions.size(), 64, [&](size_t index)
         {
-            uint32_t insn = ByteSwap(*(uint32_t*)data);
-            if (PPC_OP(insn) == PPC_OP_B && PPC_BL(insn))
+            const auto& fn = functions[index];
+            auto* data = (const uint32_t*)image.Find(fn.base, fn.size);
+            if (data == nullptr)
+                return;
+
+            for (size_t i = 0; i < fn.size / 4; i++)
             {
-                size_t address = base + (data - section.data) + PPC_BI(insn);
+                const uint32_t insn = ByteSwap(data[i]);
+                const size_t address = fn.base + i * 4;
+                bool changes = false;
 
-                if (address >= section.base && address < section.base + section.size && image.symbols.find(address) == image.symbols.end())
+                switch (PPC_OP(insn))
                 {
-                    auto data = section.data + address - section.base;
-                    auto& fn = functions.emplace_back(Function::Analyze(data, section.base + section.size - address, address));
-                    image.symbols.emplace(fmt::format("sub_{:X}", fn.base), fn.base, fn.size, Symbol_Function);
+                case 4: // VMX
+                case 5: // VMX128
+                case 6: // VMX128
+                case 48: // lfs
+                case 49: // lfsu
+                case 50: // lfd
+                case 51: // lfdu
+                case 52: // stfs
+                case 53: // stfsu
+                case 54: // stfd
+                case 55: // stfdu
+                case 59: // FPU single
+                case 63: // FPU double and fpscr
+                    changes = true;
+                    break;
+
+                case 31:
+                    switch (PPC_XOP(insn))
+                    {
+                    case 535: // lfsx
+                    case 567: // lfsux
+                    case 599: // lfdx
+                    case 631: // lfdux
+                    case 663: // stfsx
+                    case 695: // stfsux
+                    case 727: // stfdx
+                    case 759: // stfdux
+                    case 983: // stfiwx
+                        changes = true;
+                        break;
+                    }
+                    break;
+
+                case PPC_OP_B:
+                case PPC_OP_BC:
+                {
+                    // Targets outside every known function, such as import thunks, could do anything to the flush mode.
+                    size_t target = PPC_OP(insn) == PPC_OP_B ? address + PPC_BI(insn) : address + PPC_BD(insn);
+                    changes = PPC_BA(insn) || target == config.longJmpAddress || target == config.setJmpAddress || FindFunction(target) == -1;
+                    break;
                 }
-            }
-            data += 4;
-        }
 
-        data = section.data;
+                case PPC_OP_CTR:
+                    // Indirect calls could go anywhere, but switch jump tables stay inside the function.
+                    changes = PPC_XOP(insn) == 528 && config.switchTables.find(address) == config.switchTables.end(); // bcctr
+                    break;
+                }
 
-        while (data < dataEnd)
-        {
-            auto invalidInstr = config.invalidInstructions.find(ByteSwap(*(uint32_t*)data));
-            if (invalidInstr != config.invalidInstructions.end())
-            {
-                base += invalidInstr->second;
-                data += invalidInstr->second;
-                continue;
+                if (changes || config.midAsmHooks.find(address) != config.midAsmHooks.end())
+                {
+                    changesFlushMode[index] = true;
+                    break;
+                }
             }
+        });
 
-            auto fnSymbol = image.symbols.find(base);
-            if (fnSymbol != image.symbols.end() && fnSymbol->address == base && fnSymbol->type == Symbol_Function)
-            {
-                assert(fnSymbol->address == base);
+    std::vector<std::vector<size_t>> callers(functions.size());
+    for (size_t i = 0; i < functions.size(); i++)
+    {
+        for (auto callee : callGraph[i])
+            callers[callee].push_back(i);
+    }
 
-                base += fnSymbol->size;
-                data += fnSymbol->size;
-            }
-            else
-            {
-                auto& fn = functions.emplace_back(Function::Analyze(data, dataEnd - data, base));
-                image.symbols.emplace(fmt::format("sub_{:X}", fn.base), fn.base, fn.size, Symbol_Function);
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < functions.size(); i++)
+    {
+        if (changesFlushMode[i])
+            stack.push_back(i);
+    }
 
-                base += fn.size;
-                data += fn.size;
+    while (!stack.empty())
+    {
+        size_t index = stack.back();
+        stack.pop_back();
+
+        for (auto caller : callers[index])
+        {
+            if (!changesFlushMode[caller])
+            {
+                changesFlushMode[caller] = true;
+                stack.push_back(caller);
             }
         }
     }
 
-    std::sort(functions.begin(), functions.end(), [](auto& lhs, auto& rhs) { return lhs.base < rhs.base; });
+    flushModePreservingFunctions.clear();
+    for (size_t i = 0; i < functions.size(); i++)
+    {
+        if (!changesFlushMode[i])
+            flushModePreservingFunctions.emplace(functions[i].base);
+    }
+
+    fmt::println("{} of {} functions preserve the floating point flush mode", flushModePreservingFunctions.size(), functions.size());
 }
 
 bool Recompiler::Recompile(
@@ -369,6 +1379,81 @@ bool Recompiler::Recompile(
             return *(data + 1) == c_eieio;
         };
 
+    auto printRegisterHelper = [&](uint32_t address)
+        {
+            auto findHelper = [&](uint32_t start, uint32_t first, uint32_t last, uint32_t stride, uint32_t& index)
+                {
+                    if (start == 0 || address < start || (address - start) % stride != 0)
+                        return false;
+
+                    index = first + (address - start) / stride;
+                    return index < last;
+                };
+
+            uint32_t index;
+            if (findHelper(config.restGpr14Address, 14, 32, 4, index))
+            {
+                for (uint32_t i = index; i < 32; i++)
+                    println("\t{}.u64 = PPC_LOAD_U64({}.u32 + {});", r(i), r(1), -int32_t(33 - i) * 8);
+
+                if (!config.skipLr)
+                {
+                    println("\t{}.u64 = PPC_LOAD_U32({}.u32 + -8);", r(12), r(1));
+                    println("\tctx.lr = {}.u64;", r(12));
+                }
+                else if (!config.skipLrStackSlot)
+                {
+                    println("\t{}.u64 = PPC_LOAD_U32({}.u32 + -8);", r(12), r(1));
+                }
+            }
+            else if (findHelper(config.saveGpr14Address, 14, 32, 4, index))
+            {
+                for (uint32_t i = index; i < 32; i++)
+                    println("\tPPC_STORE_U64({}.u32 + {}, {}.u64);", r(1), -int32_t(33 - i) * 8, r(i));
+
+                if (!config.skipLr || !config.skipLrStackSlot)
+                    println("\tPPC_STORE_U32({}.u32 + -8, {}.u32);", r(1), r(12));
+            }
+            else if (findHelper(config.restFpr14Address, 14, 32, 4, index))
+            {
+                for (uint32_t i = index; i < 32; i++)
+                    println("\t{}.u64 = PPC_LOAD_U64({}.u32 + {});", f(i), r(12), -int32_t(32 - i) * 8);
+            }
+            else if (findHelper(config.saveFpr14Address, 14, 32, 4, index))
+            {
+                for (uint32_t i = index; i < 32; i++)
+                    println("\tPPC_STORE_U64({}.u32 + {}, {}.u64);", r(12), -int32_t(32 - i) * 8, f(i));
+            }
+            else if (findHelper(config.restVmx14Address, 14, 32, 8, index) || findHelper(config.restVmx64Address, 64, 128, 8, index))
+            {
+                uint32_t last = index < 32 ? 32 : 128;
+                for (uint32_t i = index; i < last; i++)
+                {
+                    println("\tsimde_mm_store_si128((simde__m128i*){}.u8, simde_mm_shuffle_epi8(simde_mm_load_si128((simde__m128i*)(base + (({}.u32 + {}) & ~0xF))), simde_mm_load_si128((simde__m128i*)VectorMaskL)));",
+                        v(i), r(12), -int32_t(last - i) * 16);
+                }
+
+                println("\t{}.s64 = -16;", r(11));
+            }
+            else if (findHelper(config.saveVmx14Address, 14, 32, 8, index) || findHelper(config.saveVmx64Address, 64, 128, 8, index))
+            {
+                uint32_t last = index < 32 ? 32 : 128;
+                for (uint32_t i = index; i < last; i++)
+                {
+                    println("\tsimde_mm_store_si128((simde__m128i*)(base + (({}.u32 + {}) & ~0xF)), simde_mm_shuffle_epi8(simde_mm_load_si128((simde__m128i*){}.u8), simde_mm_load_si128((simde__m128i*)VectorMaskL)));",
+                        r(12), -int32_t(last - i) * 16, v(i));
+                }
+
+                println("\t{}.s64 = -16;", r(11));
+            }
+            else
+            {
+                return false;
+            }
+
+            return true;
+        };
+
     auto printFunctionCall = [&](uint32_t address)
         {
             if (address == config.longJmpAddress)
@@ -392,14 +1477,29 @@ bool Recompiler::Recompile(
                     {
                         // print nothing
                     }
+                    else if (config.inlineRegisterHelpers && printRegisterHelper(address))
+                    {
+                        // copied the registers in place
+                    }
                     else
                     {
-                        println("\t{}(ctx, base);", targetSymbol->name);
+                        char nameBuffer[SYMBOL_NAME_BUFFER_SIZE];
+                        println("\t{}(ctx, base);", targetSymbol->GetName(nameBuffer));
                     }
                 }
                 else
                 {
-                    println("\t// ERROR {:X}", address);
+                    // Name the function a call into the middle of a function lands in, which makes the error easier to track down.
+                    auto containingSymbol = image.symbols.findContaining(address);
+                    if (containingSymbol != image.symbols.end() && containingSymbol->type == Symbol_Function)
+                    {
+                        char nameBuffer[SYMBOL_NAME_BUFFER_SIZE];
+                        println("\t// ERROR {:X}, inside {}", address, containingSymbol->GetName(nameBuffer));
+                    }
+                    else
+                    {
+                        println("\t// ERROR {:X}", address);
+                    }
                 }
             }
         };
@@ -420,6 +1520,70 @@ bool Recompiler::Recompile(
             }
         };
 
+    auto printLoadReserved = [&](uint32_t bits)
+        {
+            auto atomicRmw = MatchAtomicRmw(fn, base, data);
+            if (atomicRmw.op != AtomicRmwOp::None)
+            {
+                // The whole reservation loop maps to a single host atomic, the store conditional below always succeeds.
+                print("\t{}.u64 = __builtin_bswap{}(", r(insn.operands[0]), bits);
+                switch (atomicRmw.op)
+                {
+                case AtomicRmwOp::Exchange:
+                    print("__atomic_exchange_n");
+                    break;
+                case AtomicRmwOp::Or:
+                    print("__atomic_fetch_or");
+                    break;
+                case AtomicRmwOp::And:
+                case AtomicRmwOp::AndC:
+                    print("__atomic_fetch_and");
+                    break;
+                case AtomicRmwOp::Xor:
+                    print("__atomic_fetch_xor");
+                    break;
+                }
+
+                print("(reinterpret_cast<uint{}_t*>(base + ", bits);
+                if (insn.operands[1] != 0)
+                    print("{}.u32 + ", r(insn.operands[1]));
+                println("{}.u32), {}__builtin_bswap{}({}.u{}), __ATOMIC_SEQ_CST));", r(insn.operands[2]),
+                    atomicRmw.op == AtomicRmwOp::AndC ? "~" : "", bits, r(atomicRmw.source), bits);
+            }
+            else
+            {
+                print("\t{}.u{} = __atomic_load_n(reinterpret_cast<uint{}_t*>(base + ", reserved(), bits, bits);
+                if (insn.operands[1] != 0)
+                    print("{}.u32 + ", r(insn.operands[1]));
+                println("{}.u32), __ATOMIC_ACQUIRE);", r(insn.operands[2]));
+                println("\t{}.u64 = __builtin_bswap{}({}.u{});", r(insn.operands[0]), bits, reserved(), bits);
+            }
+        };
+
+    auto printStoreConditional = [&](uint32_t bits)
+        {
+            println("\t{}.lt = 0;", cr(0));
+            println("\t{}.gt = 0;", cr(0));
+
+            bool fused = false;
+            for (uint32_t distance = 1; distance <= 2 && !fused; distance++)
+                fused = MatchAtomicRmw(fn, base - distance * 4, data - distance).storeAddress == base;
+
+            if (fused)
+            {
+                println("\t{}.eq = 1;", cr(0));
+            }
+            else
+            {
+                print("\t{}.eq = __sync_bool_compare_and_swap(reinterpret_cast<uint{}_t*>(base + ", cr(0), bits);
+                if (insn.operands[1] != 0)
+                    print("{}.u32 + ", r(insn.operands[1]));
+                println("{}.u32), {}.s{}, __builtin_bswap{}({}.s{}));", r(insn.operands[2]), reserved(), bits, bits, r(insn.operands[0]), bits);
+            }
+
+            println("\t{}.so = {}.so;", cr(0), xer());
+        };
+
     auto printSetFlushMode = [&](bool enable)
         {
             auto newState = enable ? CSRState::VMX : CSRState::FPU;
@@ -696,7 +1860,8 @@ bool Recompiler::Recompile(
         if (!config.skipLr)
             println("\tctx.lr = 0x{:X};", base + 4);
         printFunctionCall(insn.operands[0]);
-        csrState = CSRState::Unknown; // the call could change it
+        if (flushModePreservingFunctions.find(insn.operands[0]) == flushModePreservingFunctions.end())
+            csrState = CSRState::Unknown; // the call could change it
         break;
 
     case PPC_INST_BLE:
@@ -849,7 +2014,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_EIEIO:
-        // no op
+        println("\tPPC_FENCE_EIEIO();");
         break;
 
     case PPC_INST_EXTSB:
@@ -1015,6 +2180,10 @@ bool Recompiler::Recompile(
         println("\t{}.f64 = double(float({}.f64 - {}.f64));", f(insn.operands[0]), f(insn.operands[1]), f(insn.operands[2]));
         break;
 
+    case PPC_INST_ISYNC:
+        println("\tPPC_FENCE_ISYNC();");
+        break;
+
     case PPC_INST_LBZ:
         print("\t{}.u64 = PPC_LOAD_U8(", r(insn.operands[0]));
         if (insn.operands[2] != 0)
@@ -1043,11 +2212,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_LDARX:
-        print("\t{}.u64 = *(uint64_t*)(base + ", reserved());
-        if (insn.operands[1] != 0)
-            print("{}.u32 + ", r(insn.operands[1]));
-        println("{}.u32);", r(insn.operands[2]));
-        println("\t{}.u64 = __builtin_bswap64({}.u64);", r(insn.operands[0]), reserved());
+        printLoadReserved(64);
         break;
 
     case PPC_INST_LDU:
@@ -1187,11 +2352,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_LWARX:
-        print("\t{}.u32 = *(uint32_t*)(base + ", reserved());
-        if (insn.operands[1] != 0)
-            print("{}.u32 + ", r(insn.operands[1]));
-        println("{}.u32);", r(insn.operands[2]));
-        println("\t{}.u64 = __builtin_bswap32({}.u32);", r(insn.operands[0]), reserved());
+        printLoadReserved(32);
         break;
 
     case PPC_INST_LWAX:
@@ -1209,7 +2370,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_LWSYNC:
-        // no op
+        println("\tPPC_FENCE_LWSYNC();");
         break;
 
     case PPC_INST_LWZ:
@@ -1501,13 +2662,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_STDCX:
-        println("\t{}.lt = 0;", cr(0));
-        println("\t{}.gt = 0;", cr(0));
-        print("\t{}.eq = __sync_bool_compare_and_swap(reinterpret_cast<uint64_t*>(base + ", cr(0));
-        if (insn.operands[1] != 0)
-            print("{}.u32 + ", r(insn.operands[1]));
-        println("{}.u32), {}.s64, __builtin_bswap64({}.s64));", r(insn.operands[2]), reserved(), r(insn.operands[0]));
-        println("\t{}.so = {}.so;", cr(0), xer());
+        printStoreConditional(64);
         break;
 
     case PPC_INST_STDU:
@@ -1656,13 +2811,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_STWCX:
-        println("\t{}.lt = 0;", cr(0));
-        println("\t{}.gt = 0;", cr(0));
-        print("\t{}.eq = __sync_bool_compare_and_swap(reinterpret_cast<uint32_t*>(base + ", cr(0));
-        if (insn.operands[1] != 0)
-            print("{}.u32 + ", r(insn.operands[1]));
-        println("{}.u32), {}.s32, __builtin_bswap32({}.s32));", r(insn.operands[2]), reserved(), r(insn.operands[0]));
-        println("\t{}.so = {}.so;", cr(0), xer());
+        printStoreConditional(32);
         break;
 
     case PPC_INST_STWU:
@@ -1711,7 +2860,7 @@ bool Recompiler::Recompile(
         break;
 
     case PPC_INST_SYNC:
-        // no op
+        println("\tPPC_FENCE_SYNC();");
         break;
 
     case PPC_INST_TDLGEI:
@@ -2286,14 +3435,41 @@ bool Recompiler::Recompile(const Function& fn)
 {
     auto base = fn.base;
     auto end = base + fn.size;
-    auto* data = (uint32_t*)image.Find(base);
+    auto* data = (uint32_t*)image.Find(base, fn.size);
+    if (data == nullptr)
+    {
+        fmt::println("ERROR: sub_{:X} does not fit in a section of the image", base);
+        return false;
+    }
 
     static std::unordered_set<size_t> labels;
     labels.clear();
 
+    // Stores of the link register to its stack slot and the loads that restore it,
+    // which can be skipped when the link register itself is not emitted.
+    static std::unordered_set<size_t> lrStackSlotAccesses;
+    lrStackSlotAccesses.clear();
+
+    const bool skipLrStackSlot = config.skipLr && config.skipLrStackSlot;
+
     for (size_t addr = base; addr < end; addr += 4)
     {
         const uint32_t instruction = ByteSwap(*(uint32_t*)((char*)data + addr - base));
+
+        if (skipLrStackSlot && addr + 4 < end && config.midAsmHooks.find(addr + 4) == config.midAsmHooks.end())
+        {
+            const uint32_t next = ByteSwap(*(uint32_t*)((char*)data + addr + 4 - base));
+            const uint32_t rd = PPC_RD(instruction) << 21;
+
+            // mflr rd; stw rd, -0x8(r1)
+            if (instruction == (0x7C0802A6 | rd) && next == (0x9001FFF8 | rd))
+                lrStackSlotAccesses.emplace(addr + 4);
+
+            // lwz rd, -0x8(r1); mtlr rd
+            if (instruction == (0x8001FFF8 | rd) && next == (0x7C0803A6 | rd) && config.midAsmHooks.find(addr) == config.midAsmHooks.end())
+                lrStackSlotAccesses.emplace(addr);
+        }
+
         if (!PPC_BL(instruction))
         {
             const size_t op = PPC_OP(instruction);
@@ -2374,7 +3550,7 @@ bool Recompiler::Recompile(const Function& fn)
     std::string name;
     if (symbol != image.symbols.end())
     {
-        name = symbol->name;
+        name = symbol->GetName();
     }
     else
     {
@@ -2388,6 +3564,20 @@ bool Recompiler::Recompile(const Function& fn)
     println("PPC_FUNC_IMPL(__imp__{}) {{", name);
     println("\tPPC_FUNC_PROLOGUE();");
 
+    if (unreachableFunctions.find(fn.base) != unreachableFunctions.end())
+    {
+        println("\tPPC_UNREACHABLE_FUNC(0x{:X});", fn.base);
+        println("}}\n");
+
+#ifndef XENON_RECOMP_USE_ALIAS
+        println("PPC_WEAK_FUNC({}) {{", name);
+        println("\t__imp__{}(ctx, base);", name);
+        println("}}\n");
+#endif
+
+        return true;
+    }
+
     auto switchTable = config.switchTables.end();
     bool allRecompiled = true;
     CSRState csrState = CSRState::Unknown;
@@ -2427,7 +3617,11 @@ bool Recompiler::Recompile(const Function& fn)
             if (insn.opcode->id == PPC_INST_BCTR && (*(data - 1) == 0x07008038 || *(data - 1) == 0x00000060) && switchTable == config.switchTables.end())
                 fmt::println("Found a switch jump table at {:X} with no switch table entry present", base);
 
-            if (!Recompile(fn, base, insn, data, switchTable, localVariables, csrState))
+            if (lrStackSlotAccesses.find(base) != lrStackSlotAccesses.end())
+            {
+                // the link register is not emitted, so its stack slot is never read
+            }
+            else if (!Recompile(fn, base, insn, data, switchTable, localVariables, csrState))
             {
                 fmt::println("Unrecognized instruction at 0x{:X}: {}", base, insn.opcode->name);
                 allRecompiled = false;
@@ -2504,6 +3698,28 @@ void Recompiler::Recompile(const std::filesystem::path& headerFilePath)
 {
     out.reserve(10 * 1024 * 1024);
 
+    if (config.reachableFunctionsOnly)
+        FindUnreachableFunctions();
+
+    if (config.keepCsrStateAcrossCalls)
+        FindFlushModePreservingFunctions();
+
+    // Extract the address of the minimum code segment to store the function table at.
+    size_t codeMin = ~0;
+    size_t codeMax = 0;
+
+    for (auto& section : image.sections)
+    {
+        if ((section.flags & SectionFlags_Code) != 0)
+        {
+            if (section.base < codeMin)
+                codeMin = section.base;
+
+            if ((section.base + section.size) > codeMax)
+                codeMax = (section.base + section.size);
+        }
+    }
+
     {
         println("#pragma once");
 
@@ -2526,28 +3742,15 @@ void Recompiler::Recompile(const std::filesystem::path& headerFilePath)
             println("#define PPC_CONFIG_NON_ARGUMENT_AS_LOCAL");   
         if (config.nonVolatileRegistersAsLocalVariables)
             println("#define PPC_CONFIG_NON_VOLATILE_AS_LOCAL");
+        if (config.sparseFuncTable)
+            println("#define PPC_CONFIG_SPARSE_FUNC_TABLE");
+        if (config.nonVolatileMemory)
+            println("#define PPC_CONFIG_NON_VOLATILE_MEMORY");
 
         println("");
 
         println("#define PPC_IMAGE_BASE 0x{:X}ull", image.base);
         println("#define PPC_IMAGE_SIZE 0x{:X}ull", image.size);
-        
-        // Extract the address of the minimum code segment to store the function table at.
-        size_t codeMin = ~0;
-        size_t codeMax = 0;
-
-        for (auto& section : image.sections)
-        {
-            if ((section.flags & SectionFlags_Code) != 0)
-            {
-                if (section.base < codeMin)
-                    codeMin = section.base;
-
-                if ((section.base + section.size) > codeMax)
-                    codeMax = (section.base + section.size);
-            }
-        }
-
         println("#define PPC_CODE_BASE 0x{:X}ull", codeMin);
         println("#define PPC_CODE_SIZE 0x{:X}ull", codeMax - codeMin);
 
@@ -2583,8 +3786,9 @@ void Recompiler::Recompile(const std::filesystem::path& headerFilePath)
         println("#include \"ppc_config.h\"");
         println("#include \"ppc_context.h\"\n");
 
+        char nameBuffer[SYMBOL_NAME_BUFFER_SIZE];
         for (auto& symbol : image.symbols)
-            println("PPC_EXTERN_FUNC({});", symbol.name);
+            println("PPC_EXTERN_FUNC({});", symbol.GetName(nameBuffer));
 
         SaveCurrentOutData("ppc_recomp_shared.h");
     }
@@ -2592,13 +3796,69 @@ void Recompiler::Recompile(const std::filesystem::path& headerFilePath)
     {
         println("#include \"ppc_recomp_shared.h\"\n");
 
-        println("PPCFuncMapping PPCFuncMappings[] = {{");
+        // Symbols are already sorted by address, but multiple symbols can share one.
+        // Keep only the last one, which is what filling the function table in order would do.
+        std::vector<const Symbol*> mappings;
         for (auto& symbol : image.symbols)
-            println("\t{{ 0x{:X}, {} }},", symbol.address, symbol.name);
+        {
+            if (!mappings.empty() && mappings.back()->address == symbol.address)
+                mappings.back() = &symbol;
+            else
+                mappings.push_back(&symbol);
+        }
+
+        println("const size_t PPCFuncMappingCount = {};\n", mappings.size());
+
+        char nameBuffer[SYMBOL_NAME_BUFFER_SIZE];
+        println("PPCFuncMapping PPCFuncMappings[] = {{");
+        for (auto* symbol : mappings)
+            println("\t{{ 0x{:X}, {} }},", symbol->address, symbol->GetName(nameBuffer));
 
         println("\t{{ 0, nullptr }}");
         println("}};");
 
+        if (config.sparseFuncTable)
+        {
+            std::vector<const Symbol*> entries;
+            for (auto* symbol : mappings)
+            {
+                if (symbol->address >= codeMin && symbol->address < codeMax && (symbol->address & 3) == 0)
+                    entries.push_back(symbol);
+            }
+
+            std::vector<uint64_t> bits(((codeMax - codeMin) / 4 + 63) / 64);
+            std::vector<uint32_t> ranks(bits.size());
+
+            for (auto* symbol : entries)
+            {
+                size_t index = (symbol->address - codeMin) / 4;
+                bits[index / 64] |= 1ull << (index % 64);
+            }
+
+            uint32_t rank = 0;
+            for (size_t i = 0; i < bits.size(); i++)
+            {
+                ranks[i] = rank;
+                rank += __builtin_popcountll(bits[i]);
+            }
+
+            println("\nPPCFunc* PPCFuncTableEntries[] = {{");
+            for (auto* symbol : entries)
+                println("\t{},", symbol->GetName(nameBuffer));
+            println("\tnullptr");
+            println("}};");
+
+            println("\nconst uint64_t PPCFuncTableBits[] = {{");
+            for (size_t i = 0; i < bits.size(); i++)
+                print("{}0x{:X},{}", (i % 8) == 0 ? "\t" : "", bits[i], ((i % 8) == 7 || i == bits.size() - 1) ? "\n" : " ");
+            println("}};");
+
+            println("\nconst uint32_t PPCFuncTableRanks[] = {{");
+            for (size_t i = 0; i < ranks.size(); i++)
+                print("{}{},{}", (i % 16) == 0 ? "\t" : "", ranks[i], ((i % 16) == 15 || i == ranks.size() - 1) ? "\n" : " ");
+            println("}};");
+        }
+
         SaveCurrentOutData("ppc_func_mapping.cpp");
     }
 
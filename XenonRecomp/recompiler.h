@@ -34,9 +34,23 @@ struct Recompiler
     std::string out;
     size_t cppFileIndex = 0;
     RecompilerConfig config;
+    uint64_t imageHash{};
+    uint64_t configHash{};
+
+    // Indices of the functions that each function branches to or takes the address of.
+    std::vector<std::vector<size_t>> callGraph;
+    std::unordered_set<size_t> unreachableFunctions;
+
+    // Bases of the functions that can't change the floating point flush mode, neither directly nor through their callees.
+    std::unordered_set<size_t> flushModePreservingFunctions;
+
+    // Background write of a freshly patched XEX file, waited on when the recompiler is destroyed.
+    std::future<void> patchedFileWrite;
 
     bool LoadConfig(const std::string_view& configFilePath);
 
+    void DetectRegisterHelpers();
+
     template<class... Args>
     void print(fmt::format_string<Args...> fmt, Args&&... args)
     {
@@ -52,6 +66,20 @@ struct Recompiler
 
     void Analyse();
 
+    bool LoadAnalysisCache();
+
+    void SaveAnalysisCache() const;
+
+    void RefineFunctionBoundaries(const std::unordered_set<size_t>& gapFunctions);
+
+    size_t FindFunction(size_t address) const;
+
+    void BuildCallGraph();
+
+    void FindUnreachableFunctions();
+
+    void FindFlushModePreservingFunctions();
+
     // TODO: make a RecompileArgs struct instead this is getting messy
     bool Recompile(
         const Function& fn,
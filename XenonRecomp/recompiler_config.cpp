@@ -17,8 +17,10 @@ void RecompilerConfig::Load(const std::string_view& configFilePath)
         patchedFilePath = main["patched_file_path"].value_or<std::string>("");
         outDirectoryPath = main["out_directory_path"].value_or<std::string>("");
         switchTableFilePath = main["switch_table_file_path"].value_or<std::string>("");
+        analysisCacheFilePath = main["analysis_cache_file_path"].value_or<std::string>("");
 
         skipLr = main["skip_lr"].value_or(false);
+        skipLrStackSlot = main["skip_lr_stack_slot"].value_or(false);
         skipMsr = main["skip_msr"].value_or(false);
         ctrAsLocalVariable = main["ctr_as_local"].value_or(false);
         xerAsLocalVariable = main["xer_as_local"].value_or(false);
@@ -26,6 +28,11 @@ void RecompilerConfig::Load(const std::string_view& configFilePath)
         crRegistersAsLocalVariables = main["cr_as_local"].value_or(false);
         nonArgumentRegistersAsLocalVariables = main["non_argument_as_local"].value_or(false);
         nonVolatileRegistersAsLocalVariables = main["non_volatile_as_local"].value_or(false);
+        sparseFuncTable = main["sparse_func_table"].value_or(false);
+        nonVolatileMemory = main["non_volatile_memory"].value_or(false);
+        reachableFunctionsOnly = main["reachable_functions_only"].value_or(false);
+        inlineRegisterHelpers = main["inline_register_helpers"].value_or(false);
+        keepCsrStateAcrossCalls = main["keep_csr_state_across_calls"].value_or(false);
 
         restGpr14Address = main["restgprlr_14_address"].value_or(0u);
         saveGpr14Address = main["savegprlr_14_address"].value_or(0u);
@@ -38,15 +45,6 @@ void RecompilerConfig::Load(const std::string_view& configFilePath)
         longJmpAddress = main["longjmp_address"].value_or(0u);
         setJmpAddress = main["setjmp_address"].value_or(0u);
 
-        if (restGpr14Address == 0) fmt::println("ERROR: __restgprlr_14 address is unspecified");
-        if (saveGpr14Address == 0) fmt::println("ERROR: __savegprlr_14 address is unspecified");
-        if (restFpr14Address == 0) fmt::println("ERROR: __restfpr_14 address is unspecified");
-        if (saveFpr14Address == 0) fmt::println("ERROR: __savefpr_14 address is unspecified");
-        if (restVmx14Address == 0) fmt::println("ERROR: __restvmx_14 address is unspecified");
-        if (saveVmx14Address == 0) fmt::println("ERROR: __savevmx_14 address is unspecified");
-        if (restVmx64Address == 0) fmt::println("ERROR: __restvmx_64 address is unspecified");
-        if (saveVmx64Address == 0) fmt::println("ERROR: __savevmx_64 address is unspecified");
-
         if (auto functionsArray = main["functions"].as_array())
         {
             for (auto& func : *functionsArray)
@@ -58,6 +56,12 @@ void RecompilerConfig::Load(const std::string_view& configFilePath)
             }
         }
 
+        if (auto rootsArray = main["reachable_function_roots"].as_array())
+        {
+            for (auto& root : *rootsArray)
+                reachableFunctionRoots.push_back(*root.value<uint32_t>());
+        }
+
         if (auto invalidArray = main["invalid_instructions"].as_array())
         {
             for (auto& instr : *invalidArray)
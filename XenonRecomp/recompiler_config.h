@@ -30,8 +30,10 @@ struct RecompilerConfig
     std::string patchedFilePath;
     std::string outDirectoryPath;
     std::string switchTableFilePath;
+    std::string analysisCacheFilePath;
     std::unordered_map<uint32_t, RecompilerSwitchTable> switchTables;
     bool skipLr = false;
+    bool skipLrStackSlot = false;
     bool ctrAsLocalVariable = false;
     bool xerAsLocalVariable = false;
     bool reservedRegisterAsLocalVariable = false;
@@ -39,6 +41,11 @@ struct RecompilerConfig
     bool crRegistersAsLocalVariables = false;
     bool nonArgumentRegistersAsLocalVariables = false;
     bool nonVolatileRegistersAsLocalVariables = false;
+    bool sparseFuncTable = false;
+    bool nonVolatileMemory = false;
+    bool reachableFunctionsOnly = false;
+    bool inlineRegisterHelpers = false;
+    bool keepCsrStateAcrossCalls = false;
     uint32_t restGpr14Address = 0;
     uint32_t saveGpr14Address = 0;
     uint32_t restFpr14Address = 0;
@@ -50,6 +57,7 @@ struct RecompilerConfig
     uint32_t longJmpAddress = 0;
     uint32_t setJmpAddress = 0;
     std::unordered_map<uint32_t, uint32_t> functions;
+    std::vector<uint32_t> reachableFunctionRoots;
     std::unordered_map<uint32_t, uint32_t> invalidInstructions;
     std::unordered_map<uint32_t, RecompilerMidAsmHook> midAsmHooks;
 
@@ -0,0 +1,175 @@
+#include "tests.h"
+#include <aes_cbc.h>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Key and IV of the CBC-AES128 example in NIST SP 800-38A, F.2.
+static const uint8_t c_key[16] =
+{
+    0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C,
+};
+
+static const uint8_t c_iv[16] =
+{
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+};
+
+static const uint8_t c_nistPlaintext[64] =
+{
+    0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96, 0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A,
+    0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C, 0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51,
+    0x30, 0xC8, 0x1C, 0x46, 0xA3, 0x5C, 0xE4, 0x11, 0xE5, 0xFB, 0xC1, 0x19, 0x1A, 0x0A, 0x52, 0xEF,
+    0xF6, 0x9F, 0x24, 0x45, 0xDF, 0x4F, 0x9B, 0x17, 0xAD, 0x2B, 0x41, 0x7B, 0xE6, 0x6C, 0x37, 0x10,
+};
+
+static const uint8_t c_nistCiphertext[64] =
+{
+    0x76, 0x49, 0xAB, 0xAC, 0x81, 0x19, 0xB2, 0x46, 0xCE, 0xE9, 0x8E, 0x9B, 0x12, 0xE9, 0x19, 0x7D,
+    0x50, 0x86, 0xCB, 0x9B, 0x50, 0x72, 0x19, 0xEE, 0x95, 0xDB, 0x11, 0x3A, 0x91, 0x76, 0x78, 0xB2,
+    0x73, 0xBE, 0xD6, 0xB8, 0xE3, 0xC1, 0x74, 0x3B, 0x71, 0x16, 0xE6, 0x9E, 0x22, 0x22, 0x95, 0x16,
+    0x3F, 0xF1, 0xCA, 0xA1, 0x68, 0x1F, 0xAC, 0x09, 0x12, 0x0E, 0xCA, 0x30, 0x75, 0x86, 0xE1, 0xA7,
+};
+
+// 20 blocks of GetLongPlaintext bytes encrypted with OpenSSL, using the key and IV above.
+// That's enough for the hardware paths to go through both their 8 block loop and their single block loop.
+static const uint8_t c_longCiphertext[320] =
+{
+    0xF9, 0xCF, 0x35, 0x90, 0x59, 0x47, 0xCD, 0xE9, 0x81, 0xC2, 0xC2, 0x07, 0x25, 0x50, 0xF3, 0xD7,
+    0xDB, 0x7E, 0x4F, 0x81, 0x40, 0x6A, 0x74, 0xEE, 0x68, 0xBA, 0x4B, 0x58, 0xD1, 0xEF, 0x25, 0xCA,
+    0x4E, 0x5C, 0xCE, 0x6C, 0xF3, 0xC0, 0xA8, 0x62, 0x49, 0xEB, 0x01, 0xA1, 0x7C, 0x27, 0xE1, 0xBC,
+    0xF8, 0xE1, 0xD6, 0x70, 0x2A, 0x7B, 0x19, 0xE1, 0xB7, 0xF0, 0x96, 0x39, 0xCC, 0x46, 0x24, 0xD1,
+    0xBF, 0x60, 0x3F, 0xF1, 0xB1, 0x5C, 0x98, 0x4A, 0xB8, 0xEC, 0x67, 0xF8, 0x20, 0x63, 0x6C, 0x62,
+    0x48, 0x60, 0x58, 0x43, 0x3B, 0x82, 0xDB, 0x91, 0xA1, 0x6E, 0x9C, 0xFC, 0x84, 0xEA, 0x27, 0xA0,
+    0x38, 0x5F, 0x33, 0x4E, 0xF5, 0x0E, 0xDE, 0xC4, 0x87, 0x98, 0xEB, 0x4D, 0xB7, 0x65, 0xDC, 0x00,
+    0xE5, 0xF9, 0xA5, 0x32, 0x6C, 0x9C, 0x3E, 0x65, 0x53, 0x76, 0x31, 0xED, 0xA0, 0x56, 0x89, 0x7D,
+    0x6E, 0xAF, 0x8E, 0x51, 0xAF, 0x41, 0x96, 0xE4, 0x85, 0xFD, 0x92, 0x20, 0x44, 0xA9, 0x2B, 0x60,
+    0xA8, 0x62, 0x23, 0x37, 0xD9, 0x7D, 0xFB, 0xDA, 0x20, 0x8A, 0x52, 0xCD, 0x90, 0x78, 0xEC, 0x62,
+    0x95, 0x41, 0x75, 0x50, 0x2B, 0xD7, 0xFF, 0x92, 0xFC, 0xD7, 0x96, 0xDE, 0x34, 0xF4, 0x35, 0xAA,
+    0x03, 0x08, 0x93, 0x94, 0x08, 0x42, 0xD1, 0x4B, 0xA8, 0x36, 0x5E, 0x6B, 0x52, 0x00, 0x82, 0x3A,
+    0x87, 0xDE, 0xBB, 0x18, 0x40, 0x14, 0x85, 0xAD, 0x5D, 0xF4, 0xBB, 0x4D, 0x7F, 0x28, 0x6F, 0x26,
+    0xD5, 0x98, 0x27, 0x80, 0xF1, 0xDB, 0xAD, 0xF4, 0xD5, 0x64, 0x04, 0x06, 0x6A, 0x7B, 0xD4, 0x21,
+    0x45, 0xD6, 0x6C, 0x5A, 0xD4, 0xAA, 0x5D, 0x93, 0xC1, 0x13, 0x13, 0xD0, 0x42, 0x2D, 0xFB, 0x1C,
+    0x55, 0x86, 0xF9, 0xE4, 0x5C, 0xA4, 0x66, 0x10, 0x00, 0xCD, 0x7D, 0xE5, 0xA6, 0x32, 0x9B, 0xE0,
+    0xC6, 0x61, 0x15, 0xE6, 0xB9, 0xEE, 0xA0, 0x8C, 0x43, 0xD3, 0xBD, 0x2A, 0xD9, 0xEA, 0xD4, 0x2B,
+    0xF1, 0x0A, 0x2C, 0xDB, 0x00, 0x92, 0xCB, 0xC2, 0x90, 0x38, 0x45, 0x81, 0x82, 0x67, 0x1A, 0x2D,
+    0xD9, 0x0B, 0xAE, 0xC6, 0xCD, 0x48, 0x86, 0x06, 0x94, 0x1B, 0xDC, 0x56, 0x4B, 0xD9, 0x25, 0x51,
+    0x3C, 0x02, 0x85, 0x8B, 0x5B, 0xC0, 0x1E, 0x8B, 0x3A, 0xD3, 0x2F, 0x86, 0xC1, 0xF9, 0x7E, 0xE3,
+};
+
+static uint8_t GetLongPlaintext(size_t index)
+{
+    return uint8_t(index * 37 + 11);
+}
+
+enum class AesImplementation
+{
+    Default,
+    Portable,
+    Hardware,
+};
+
+static const char* GetName(AesImplementation implementation)
+{
+    switch (implementation)
+    {
+    case AesImplementation::Portable:
+        return "portable";
+
+    case AesImplementation::Hardware:
+        return "hardware";
+
+    default:
+        return "default";
+    }
+}
+
+// Returns false if the implementation isn't available on this CPU.
+static bool Decrypt(AesImplementation implementation, uint8_t* data, size_t size)
+{
+    switch (implementation)
+    {
+    case AesImplementation::Portable:
+        AesCbcDecryptPortable(c_key, c_iv, data, size);
+        return true;
+
+    case AesImplementation::Hardware:
+        return AesCbcDecryptHardware(c_key, c_iv, data, size);
+
+    default:
+        AesCbcDecrypt(c_key, c_iv, data, size);
+        return true;
+    }
+}
+
+void TestAesCbc()
+{
+    for (auto implementation : { AesImplementation::Default, AesImplementation::Portable, AesImplementation::Hardware })
+    {
+        uint8_t nist[sizeof(c_nistCiphertext)];
+        memcpy(nist, c_nistCiphertext, sizeof(nist));
+
+        if (!Decrypt(implementation, nist, sizeof(nist)))
+        {
+            fmt::println("AES-128-CBC: {} implementation unavailable, skipped", GetName(implementation));
+            continue;
+        }
+
+        CHECK(memcmp(nist, c_nistPlaintext, sizeof(nist)) == 0);
+
+        // Every block count from empty to the whole vector, followed by a partial block that must be left untouched.
+        for (size_t blockCount = 0; blockCount <= sizeof(c_longCiphertext) / 16; blockCount++)
+        {
+            for (size_t tailSize : { 0, 1, 7, 15 })
+            {
+                const size_t size = blockCount * 16 + tailSize;
+                std::vector<uint8_t> data(c_longCiphertext, c_longCiphertext + blockCount * 16);
+                data.resize(size, 0xA5);
+
+                Decrypt(implementation, data.data(), size);
+
+                bool matches = true;
+                for (size_t i = 0; i < size; i++)
+                    matches &= data[i] == (i < blockCount * 16 ? GetLongPlaintext(i) : 0xA5);
+
+                CHECK(matches);
+            }
+        }
+    }
+
+    // The hardware path must agree with the portable one on arbitrary data too.
+    std::mt19937 random(42);
+    for (size_t i = 0; i < 64; i++)
+    {
+        std::vector<uint8_t> hardware(random() % 2048);
+        for (auto& value : hardware)
+            value = uint8_t(random());
+
+        std::vector<uint8_t> portable = hardware;
+        AesCbcDecryptPortable(c_key, c_iv, portable.data(), portable.size());
+
+        if (AesCbcDecryptHardware(c_key, c_iv, hardware.data(), hardware.size()))
+            CHECK(hardware == portable);
+    }
+}
+
+void BenchmarkAesCbc()
+{
+    // A synthetic payload the size of a large XEX. CBC decryption runs at the same speed whatever the data is.
+    std::vector<uint8_t> payload(64 * 1024 * 1024);
+    std::mt19937 random(42);
+    for (auto& value : payload)
+        value = uint8_t(random());
+
+    for (auto implementation : { AesImplementation::Portable, AesImplementation::Hardware })
+    {
+        bool available = true;
+        const double throughput = MeasureThroughput(payload.size(), [&]()
+            {
+                available = Decrypt(implementation, payload.data(), payload.size());
+            });
+
+        if (available)
+            fmt::println("AES-128-CBC {}: {:.0f} MB/s", GetName(implementation), throughput);
+    }
+}
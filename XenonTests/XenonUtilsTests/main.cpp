@@ -0,0 +1,20 @@
+#include "tests.h"
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+    TestAesCbc();
+    TestSha1();
+    TestSymbolTable();
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+    {
+        BenchmarkAesCbc();
+        BenchmarkSha1();
+        BenchmarkSymbolTable();
+    }
+
+    fmt::println("{} of {} checks passed", g_checkCount - g_failureCount, g_checkCount);
+    return g_failureCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,103 @@
+#include "tests.h"
+#include <sha1.h>
+#include <random>
+#include <string>
+#include <vector>
+
+// Digests of MakeMessage bytes computed with Python's hashlib. The lengths put the padding on either side
+// of the point where it needs a second block, with and without a whole block before the tail.
+struct Sha1Vector
+{
+    size_t size;
+    const char* digest;
+};
+
+static const Sha1Vector c_sha1Vectors[] =
+{
+    { 0, "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+    { 55, "c4622048cfef59b72875839ee7ae1cbcf55e7658" },
+    { 56, "ddc12942656468475970fa4fa49161f52ed138e4" },
+    { 63, "7f8c3fa49f1297bd8b9feb964b6b419987f9f0d1" },
+    { 64, "a334b47180c61fd522f99905ec02c36f9e848211" },
+    { 119, "bea949473b1ec34747ce121c3293624b5d9d8f84" },
+    { 1000, "2c4169b2993df842a68ce33d5a1120339ab1057f" },
+};
+
+static std::vector<uint8_t> MakeMessage(size_t size)
+{
+    std::vector<uint8_t> message(size);
+    for (size_t i = 0; i < size; i++)
+        message[i] = uint8_t(i * 37 + 11);
+
+    return message;
+}
+
+static std::string ToHex(const uint8_t (&digest)[20])
+{
+    std::string hex;
+    for (auto value : digest)
+        hex += fmt::format("{:02x}", value);
+
+    return hex;
+}
+
+void TestSha1()
+{
+    bool hasHardware = true;
+
+    for (const auto& vector : c_sha1Vectors)
+    {
+        const auto message = MakeMessage(vector.size);
+
+        uint8_t digest[20];
+        Sha1Digest(message.data(), message.size(), digest);
+        CHECK(ToHex(digest) == vector.digest);
+
+        Sha1DigestPortable(message.data(), message.size(), digest);
+        CHECK(ToHex(digest) == vector.digest);
+
+        if (Sha1DigestHardware(message.data(), message.size(), digest))
+            CHECK(ToHex(digest) == vector.digest);
+        else
+            hasHardware = false;
+    }
+
+    if (!hasHardware)
+    {
+        fmt::println("SHA-1: hardware implementation unavailable, skipped");
+        return;
+    }
+
+    // The hardware path must agree with the portable one on every tail size and on arbitrary data.
+    std::mt19937 random(42);
+    for (size_t size = 0; size < 300; size++)
+    {
+        std::vector<uint8_t> message(size);
+        for (auto& value : message)
+            value = uint8_t(random());
+
+        uint8_t hardware[20];
+        uint8_t portable[20];
+        Sha1DigestHardware(message.data(), message.size(), hardware);
+        Sha1DigestPortable(message.data(), message.size(), portable);
+        CHECK(ToHex(hardware) == ToHex(portable));
+    }
+}
+
+void BenchmarkSha1()
+{
+    std::vector<uint8_t> payload(64 * 1024 * 1024);
+    std::mt19937 random(42);
+    for (auto& value : payload)
+        value = uint8_t(random());
+
+    uint8_t digest[20];
+
+    const double portable = MeasureThroughput(payload.size(), [&]() { Sha1DigestPortable(payload.data(), payload.size(), digest); });
+    fmt::println("SHA-1 portable: {:.0f} MB/s", portable);
+
+    bool available = true;
+    const double hardware = MeasureThroughput(payload.size(), [&]() { available = Sha1DigestHardware(payload.data(), payload.size(), digest); });
+    if (available)
+        fmt::println("SHA-1 hardware: {:.0f} MB/s", hardware);
+}
@@ -0,0 +1,216 @@
+#include "tests.h"
+#include <symbol_table.h>
+#include <random>
+#include <set>
+#include <vector>
+
+// The std::multiset based table SymbolTable replaced, kept as the reference its behavior is checked against.
+class LegacySymbolTable : public std::multiset<Symbol, SymbolComparer>
+{
+public:
+    const_iterator find(size_t address) const
+    {
+        auto [beginIt, endIt] = equal_range(address);
+        if (beginIt == endIt)
+        {
+            return end();
+        }
+
+        size_t closest{ address - beginIt->address };
+        auto match = end();
+        for (auto it = beginIt; it != endIt; ++it)
+        {
+            if (address < it->address || address >= it->address + it->size)
+            {
+                continue;
+            }
+
+            const size_t distance = address - it->address;
+            if (distance <= closest)
+            {
+                match = it;
+                closest = distance;
+            }
+        }
+
+        return match;
+    }
+};
+
+static bool IsSameSymbol(const Symbol& lhs, const Symbol& rhs)
+{
+    return lhs.name == rhs.name && lhs.address == rhs.address && lhs.size == rhs.size && lhs.type == rhs.type;
+}
+
+static bool IsSameTable(const SymbolTable& table, const LegacySymbolTable& legacy)
+{
+    return table.size() == legacy.size() && std::equal(table.begin(), table.end(), legacy.begin(), IsSameSymbol);
+}
+
+void TestSymbolTable()
+{
+    // Few distinct addresses, so symbols often share one, and small sizes so they often overlap.
+    std::mt19937 random(42);
+    auto makeSymbol = [&](size_t index)
+        {
+            const size_t address = 0x82000000 + (random() % 512) * 4;
+            const size_t size = (random() % 4) * 8;
+            const auto type = random() % 4 == 0 ? Symbol_Comment : Symbol_Function;
+            return random() % 2 == 0 ? Symbol(address, size, type) : Symbol(fmt::format("symbol_{}", index), address, size, type);
+        };
+
+    SymbolTable table;
+    LegacySymbolTable legacy;
+    size_t symbolIndex = 0;
+
+    for (size_t round = 0; round < 2000; round++)
+    {
+        switch (random() % 5)
+        {
+        case 0:
+        {
+            auto symbol = makeSymbol(symbolIndex++);
+            legacy.insert(symbol);
+            table.insert(std::move(symbol));
+            break;
+        }
+
+        case 1:
+        {
+            std::vector<Symbol> batch;
+            for (size_t i = random() % 32; i != 0; i--)
+            {
+                batch.push_back(makeSymbol(symbolIndex++));
+                legacy.insert(batch.back());
+            }
+
+            table.insert(std::move(batch));
+            break;
+        }
+
+        case 2:
+        {
+            // The way the recompiler removes the functions at an address.
+            const size_t address = 0x82000000 + (random() % 512) * 4;
+
+            auto [begin, end] = table.equal_range(address);
+            auto removed = std::remove_if(begin, end, [](const Symbol& symbol) { return symbol.type == Symbol_Function; });
+            table.erase(removed, end);
+
+            auto [legacyBegin, legacyEnd] = legacy.equal_range(address);
+            for (auto it = legacyBegin; it != legacyEnd;)
+                it = it->type == Symbol_Function ? legacy.erase(it) : std::next(it);
+
+            break;
+        }
+
+        case 3:
+        {
+            // Sizes aren't part of the ordering, so the legacy table can be updated in place as well.
+            const size_t address = 0x82000000 + (random() % 512) * 4;
+            const size_t size = (random() % 8) * 8;
+
+            auto [begin, end] = table.equal_range(address);
+            for (auto it = begin; it != end; ++it)
+                table.setSize(it, size);
+
+            auto [legacyBegin, legacyEnd] = legacy.equal_range(address);
+            for (auto it = legacyBegin; it != legacyEnd; ++it)
+                const_cast<Symbol&>(*it).size = size;
+
+            break;
+        }
+
+        default:
+        {
+            const size_t address = 0x82000000 + random() % (512 * 4 + 64);
+
+            auto it = table.find(address);
+            auto legacyIt = legacy.find(address);
+            CHECK((it == table.end()) == (legacyIt == legacy.end()));
+            if (it != table.end() && legacyIt != legacy.end())
+                CHECK(IsSameSymbol(*it, *legacyIt));
+
+            // The closest symbol starting at or before the address that contains it, the last added one on ties.
+            auto expected = legacy.end();
+            for (auto legacyIt = legacy.begin(); legacyIt != legacy.end() && legacyIt->address <= address; ++legacyIt)
+            {
+                if (address < legacyIt->address + legacyIt->size)
+                    expected = legacyIt;
+            }
+
+            auto containing = table.findContaining(address);
+            CHECK((containing == table.end()) == (expected == legacy.end()));
+            if (containing != table.end() && expected != legacy.end())
+                CHECK(IsSameSymbol(*containing, *expected));
+
+            break;
+        }
+        }
+
+        CHECK(IsSameTable(table, legacy));
+    }
+}
+
+void BenchmarkSymbolTable()
+{
+    // About as many symbols as a large game, added in a random order and then looked up at random.
+    constexpr size_t c_symbolCount = 500000;
+    constexpr size_t c_lookupCount = 2000000;
+
+    std::vector<Symbol> symbols;
+    symbols.reserve(c_symbolCount);
+    for (size_t i = 0; i < c_symbolCount; i++)
+        symbols.emplace_back(0x82000000 + i * 16, 16, Symbol_Function);
+
+    std::mt19937 random(42);
+    std::shuffle(symbols.begin(), symbols.end(), random);
+
+    std::vector<size_t> lookups(c_lookupCount);
+    for (auto& address : lookups)
+        address = 0x82000000 + (random() % c_symbolCount) * 16;
+
+    size_t found = 0;
+
+    const double legacyBuild = MeasureThroughput(c_symbolCount, [&]()
+        {
+            LegacySymbolTable legacy;
+            for (const auto& symbol : symbols)
+                legacy.insert(symbol);
+        });
+
+    const double tableBuild = MeasureThroughput(c_symbolCount, [&]()
+        {
+            SymbolTable table;
+            table.insert(std::vector<Symbol>(symbols));
+        });
+
+    LegacySymbolTable legacy;
+    legacy.insert(symbols.begin(), symbols.end());
+    SymbolTable table;
+    table.insert(std::vector<Symbol>(symbols));
+
+    const double legacyFind = MeasureThroughput(c_lookupCount, [&]()
+        {
+            for (auto address : lookups)
+                found += legacy.find(address) != legacy.end();
+        });
+
+    const double tableFind = MeasureThroughput(c_lookupCount, [&]()
+        {
+            for (auto address : lookups)
+                found += table.find(address) != table.end();
+        });
+
+    const double tableFindContaining = MeasureThroughput(c_lookupCount, [&]()
+        {
+            for (auto address : lookups)
+                found += table.findContaining(address + 4) != table.end();
+        });
+
+    fmt::println("SymbolTable building {} symbols: multiset {:.1f}M/s, flat {:.1f}M/s", c_symbolCount, legacyBuild, tableBuild);
+    fmt::println("SymbolTable finding {} addresses: multiset {:.1f}M/s, flat {:.1f}M/s, containing {:.1f}M/s",
+        c_lookupCount, legacyFind, tableFind, tableFindContaining);
+
+    CHECK(found == c_lookupCount * 5 * 3);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <fmt/core.h>
+
+// Checks keep going after a failure, so a single run reports every failing case.
+inline size_t g_checkCount;
+inline size_t g_failureCount;
+
+inline void Check(bool condition, const char* expression, const char* file, int line)
+{
+    g_checkCount++;
+    if (!condition)
+    {
+        g_failureCount++;
+        fmt::println("FAILED: {} ({}:{})", expression, file, line);
+    }
+}
+
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+// Runs a function that processes count items a few times and returns the best throughput in millions of items per second,
+// which is MB/s when the items are bytes.
+template<typename Function>
+inline double MeasureThroughput(size_t count, Function&& function)
+{
+    double bestSeconds = 0.0;
+    for (size_t i = 0; i < 5; i++)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        function();
+        const std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+
+        if (i == 0 || seconds.count() < bestSeconds)
+            bestSeconds = seconds.count();
+    }
+
+    return count / 1000000.0 / std::max(bestSeconds, 1e-9);
+}
+
+void TestAesCbc();
+void BenchmarkAesCbc();
+
+void TestSha1();
+void BenchmarkSha1();
+
+void TestSymbolTable();
+void BenchmarkSymbolTable();
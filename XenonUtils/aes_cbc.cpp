@@ -0,0 +1,201 @@
+#include "aes_cbc.h"
+#include <aes.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#   define AES_CBC_X86
+#   include <immintrin.h>
+#   if defined(_WIN32)
+#       include <intrin.h>
+#   else
+#       include <cpuid.h>
+#   endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#   define AES_CBC_ARM64
+#   include <arm_neon.h>
+#   if defined(_WIN32)
+#       include <Windows.h>
+#   elif defined(__linux__)
+#       include <sys/auxv.h>
+#       include <asm/hwcap.h>
+#   endif
+#endif
+
+// Blocks decrypted at once. CBC decryption of a block only depends on the ciphertext,
+// so the hardware paths keep this many blocks in flight to hide the latency of the AES instructions.
+static constexpr size_t c_aesParallelBlocks = 8;
+
+void AesCbcDecryptPortable(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size)
+{
+    AES_ctx aesContext;
+    AES_init_ctx_iv(&aesContext, key, iv);
+    AES_CBC_decrypt_buffer(&aesContext, data, size - size % 16);
+}
+
+#if defined(AES_CBC_X86)
+
+static bool HasAesInstructions()
+{
+#if defined(_WIN32)
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 1);
+    return (cpuInfo[2] & (1 << 25)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) != 0;
+#endif
+}
+
+__attribute__((target("aes,sse2")))
+static void AesCbcDecryptInstructions(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size)
+{
+    AES_ctx aesContext;
+    AES_init_ctx(&aesContext, key);
+
+    // Round keys for the equivalent inverse cipher.
+    __m128i roundKeys[11];
+    roundKeys[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aesContext.RoundKey + 160));
+    for (size_t i = 1; i < 10; i++)
+        roundKeys[i] = _mm_aesimc_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(aesContext.RoundKey + (10 - i) * 16)));
+    roundKeys[10] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aesContext.RoundKey));
+
+    __m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+    auto* blocks = reinterpret_cast<__m128i*>(data);
+    size_t blockCount = size / 16;
+    size_t i = 0;
+
+    for (; i + c_aesParallelBlocks <= blockCount; i += c_aesParallelBlocks)
+    {
+        __m128i cipher[c_aesParallelBlocks];
+        __m128i state[c_aesParallelBlocks];
+
+        for (size_t j = 0; j < c_aesParallelBlocks; j++)
+        {
+            cipher[j] = _mm_loadu_si128(blocks + i + j);
+            state[j] = _mm_xor_si128(cipher[j], roundKeys[0]);
+        }
+
+        for (size_t round = 1; round < 10; round++)
+        {
+            for (size_t j = 0; j < c_aesParallelBlocks; j++)
+                state[j] = _mm_aesdec_si128(state[j], roundKeys[round]);
+        }
+
+        for (size_t j = 0; j < c_aesParallelBlocks; j++)
+        {
+            state[j] = _mm_aesdeclast_si128(state[j], roundKeys[10]);
+            _mm_storeu_si128(blocks + i + j, _mm_xor_si128(state[j], j == 0 ? previous : cipher[j - 1]));
+        }
+
+        previous = cipher[c_aesParallelBlocks - 1];
+    }
+
+    for (; i < blockCount; i++)
+    {
+        __m128i cipher = _mm_loadu_si128(blocks + i);
+        __m128i state = _mm_xor_si128(cipher, roundKeys[0]);
+
+        for (size_t round = 1; round < 10; round++)
+            state = _mm_aesdec_si128(state, roundKeys[round]);
+
+        state = _mm_aesdeclast_si128(state, roundKeys[10]);
+        _mm_storeu_si128(blocks + i, _mm_xor_si128(state, previous));
+
+        previous = cipher;
+    }
+}
+
+#elif defined(AES_CBC_ARM64)
+
+static bool HasAesInstructions()
+{
+#if defined(__APPLE__)
+    return true;
+#elif defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return false;
+#endif
+}
+
+__attribute__((target("aes")))
+static void AesCbcDecryptInstructions(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size)
+{
+    AES_ctx aesContext;
+    AES_init_ctx(&aesContext, key);
+
+    // Round keys for the equivalent inverse cipher. AESD adds the round key before the substitution,
+    // so the key of the last round is applied with a plain XOR.
+    uint8x16_t roundKeys[11];
+    roundKeys[0] = vld1q_u8(aesContext.RoundKey + 160);
+    for (size_t i = 1; i < 10; i++)
+        roundKeys[i] = vaesimcq_u8(vld1q_u8(aesContext.RoundKey + (10 - i) * 16));
+    roundKeys[10] = vld1q_u8(aesContext.RoundKey);
+
+    uint8x16_t previous = vld1q_u8(iv);
+    size_t blockCount = size / 16;
+    size_t i = 0;
+
+    for (; i + c_aesParallelBlocks <= blockCount; i += c_aesParallelBlocks)
+    {
+        uint8x16_t cipher[c_aesParallelBlocks];
+        uint8x16_t state[c_aesParallelBlocks];
+
+        for (size_t j = 0; j < c_aesParallelBlocks; j++)
+        {
+            cipher[j] = vld1q_u8(data + (i + j) * 16);
+            state[j] = cipher[j];
+        }
+
+        for (size_t round = 0; round < 9; round++)
+        {
+            for (size_t j = 0; j < c_aesParallelBlocks; j++)
+                state[j] = vaesimcq_u8(vaesdq_u8(state[j], roundKeys[round]));
+        }
+
+        for (size_t j = 0; j < c_aesParallelBlocks; j++)
+        {
+            state[j] = veorq_u8(vaesdq_u8(state[j], roundKeys[9]), roundKeys[10]);
+            vst1q_u8(data + (i + j) * 16, veorq_u8(state[j], j == 0 ? previous : cipher[j - 1]));
+        }
+
+        previous = cipher[c_aesParallelBlocks - 1];
+    }
+
+    for (; i < blockCount; i++)
+    {
+        uint8x16_t cipher = vld1q_u8(data + i * 16);
+        uint8x16_t state = cipher;
+
+        for (size_t round = 0; round < 9; round++)
+            state = vaesimcq_u8(vaesdq_u8(state, roundKeys[round]));
+
+        state = veorq_u8(vaesdq_u8(state, roundKeys[9]), roundKeys[10]);
+        vst1q_u8(data + i * 16, veorq_u8(state, previous));
+
+        previous = cipher;
+    }
+}
+
+#endif
+
+bool AesCbcDecryptHardware(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size)
+{
+#if defined(AES_CBC_X86) || defined(AES_CBC_ARM64)
+    static const bool hasAesInstructions = HasAesInstructions();
+    if (hasAesInstructions)
+    {
+        AesCbcDecryptInstructions(key, iv, data, size);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+void AesCbcDecrypt(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size)
+{
+    if (!AesCbcDecryptHardware(key, iv, data, size))
+        AesCbcDecryptPortable(key, iv, data, size);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Decrypts data in place with AES-128 in CBC mode, using the AES instructions of the host CPU when they are available.
+// Only whole 16 byte blocks are decrypted, any trailing bytes are left untouched.
+void AesCbcDecrypt(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size);
+
+// The two implementations AesCbcDecrypt picks from, exposed so they can be checked against each other.
+// AesCbcDecryptHardware returns false without touching the data if the host CPU has no AES instructions.
+void AesCbcDecryptPortable(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size);
+bool AesCbcDecryptHardware(const uint8_t* key, const uint8_t* iv, uint8_t* data, size_t size);
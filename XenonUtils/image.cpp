@@ -1,35 +1,147 @@
 #include "image.h"
 #include "elf.h"
 #include "xex.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
+ImageLoader::ImageLoader(size_t size)
+    : size(size), pages((size + PAGE_SIZE - 1) / PAGE_SIZE)
+{
+}
+
+bool ImageLoader::Load(uint8_t* data, size_t offset, size_t size)
+{
+    const size_t end = std::min(offset + size, this->size);
+    if (offset >= end)
+        return true;
+
+    const size_t firstPage = offset / PAGE_SIZE;
+    const size_t lastPage = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    auto isLoaded = [&]()
+        {
+            for (size_t i = firstPage; i < lastPage; i++)
+            {
+                if (!pages[i].load(std::memory_order_acquire))
+                    return false;
+            }
+
+            return true;
+        };
+
+    if (isLoaded())
+        return true;
+
+    std::lock_guard lock(mutex);
+
+    for (size_t i = firstPage; i < lastPage;)
+    {
+        if (pages[i].load(std::memory_order_relaxed))
+        {
+            i++;
+            continue;
+        }
+
+        size_t runEnd = i + 1;
+        while (runEnd < lastPage && !pages[runEnd].load(std::memory_order_relaxed))
+            runEnd++;
+
+        size_t decodedBegin = i * PAGE_SIZE;
+        if (failed || !Decode(data, decodedBegin, std::min(runEnd * PAGE_SIZE, this->size)))
+        {
+            failed = true;
+            return false;
+        }
+
+        for (size_t j = decodedBegin / PAGE_SIZE; j < runEnd; j++)
+            pages[j].store(true, std::memory_order_release);
+
+        i = runEnd;
+    }
+
+    return true;
+}
+
 void Image::Map(const std::string_view& name, size_t base, uint32_t size, uint8_t flags, uint8_t* data)
 {
-    sections.insert({ std::string(name), this->base + base,
+    const auto it = std::upper_bound(sections.begin(), sections.end(), this->base + base, SectionComparer());
+    sections.insert(it, { std::string(name), this->base + base,
         size, static_cast<SectionFlags>(flags), data });
+
+    sectionIndices.clear();
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        sectionIndices.emplace(sections[i].name, i);
+    }
+}
+
+bool Image::Load(size_t offset, size_t size) const
+{
+    if (loader != nullptr)
+    {
+        return loader->Load(data.get(), offset, size);
+    }
+
+    return true;
+}
+
+const Section* Image::FindSection(size_t address) const
+{
+    const auto it = std::upper_bound(sections.begin(), sections.end(), address, SectionComparer());
+    if (it == sections.begin() || !(*std::prev(it) == address))
+    {
+        return nullptr;
+    }
+
+    return &*std::prev(it);
 }
 
 const void* Image::Find(size_t address) const
 {
-    const auto section = std::prev(sections.upper_bound(address));
+    const auto* section = FindSection(address);
+    if (section == nullptr)
+    {
+        return nullptr;
+    }
+
+    if (!Load(section->data - data.get(), section->size))
+    {
+        return nullptr;
+    }
+
     return section->data + (address - section->base);
 }
 
+const void* Image::Find(size_t address, size_t size) const
+{
+    const auto* section = FindSection(address);
+    if (section == nullptr || size > section->base + section->size - address)
+    {
+        return nullptr;
+    }
+
+    return Find(address);
+}
+
 const Section* Image::Find(const std::string_view& name) const
 {
-    for (const auto& section : sections)
+    const auto it = sectionIndices.find(std::string(name));
+    if (it == sectionIndices.end())
     {
-        if (section.name == name)
-        {
-            return &section;
-        }
+        return nullptr;
+    }
+
+    const auto& section = sections[it->second];
+    if (!Load(section.data - data.get(), section.size))
+    {
+        return nullptr;
     }
 
-    return nullptr;
+    return &section;
 }
 
-Image Image::ParseImage(const uint8_t* data, size_t size)
+Image Image::ParseImage(const uint8_t* data, size_t size, bool lazy)
 {
     if (data[0] == ELFMAG0 && data[1] == ELFMAG1 && data[2] == ELFMAG2 && data[3] == ELFMAG3)
     {
@@ -37,7 +149,7 @@ Image Image::ParseImage(const uint8_t* data, size_t size)
     }
     else if (data[0] == 'X' && data[1] == 'E' && data[2] == 'X' && data[3] == '2')
     {
-        return Xex2LoadImage(data, size);
+        return Xex2LoadImage(data, size, lazy);
     }
 
     return {};
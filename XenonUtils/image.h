@@ -1,18 +1,57 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <set>
+#include <unordered_map>
+#include <vector>
 #include <section.h>
 #include "symbol_table.h"
 
+/**
+ * \brief Decodes the data of a lazily loaded image a page at a time, on first access
+ */
+struct ImageLoader
+{
+    static constexpr size_t PAGE_SIZE = 0x1000;
+
+    size_t size{};
+    std::vector<std::atomic<bool>> pages;
+    std::mutex mutex;
+    bool failed{}; // Set once decoding failed, nothing gets decoded after that
+
+    ImageLoader(size_t size);
+    virtual ~ImageLoader() = default;
+
+    /**
+     * \brief Makes sure a range of the image data is decoded, can be called from multiple threads
+     * \param data Image data
+     * \param offset Offset of the range
+     * \param size Size of the range
+     * \return False if the range couldn't be decoded
+     */
+    bool Load(uint8_t* data, size_t offset, size_t size);
+
+    /**
+     * \brief Decodes a range of pages that aren't decoded yet, called with the mutex locked
+     * \param data Image data
+     * \param begin Page aligned offset of the range, lowered to the offset from which the data got decoded
+     * \param end End of the range, page aligned unless it's the end of the image
+     * \return False if the data couldn't be decoded, the pages are then left undecoded
+     */
+    virtual bool Decode(uint8_t* data, size_t& begin, size_t end) = 0;
+};
+
 struct Image
 {
     std::unique_ptr<uint8_t[]> data{};
+    std::unique_ptr<ImageLoader> loader{};
     size_t base{};
     uint32_t size{};
 
     size_t entry_point{};
-    std::set<Section, SectionComparer> sections{};
+    std::vector<Section> sections{}; // Sorted by base
+    std::unordered_map<std::string, size_t> sectionIndices{}; // Index of the first section with each name
     SymbolTable symbols{};
 
     /**
@@ -25,15 +64,37 @@ struct Image
      */
     void Map(const std::string_view& name, size_t base, uint32_t size, uint8_t flags, uint8_t* data);
 
+    /**
+     * \brief Decodes the data of a lazily loaded image, does nothing for fully loaded images
+     * \param offset Offset into the image data
+     * \param size Size of the range
+     * \return False if the range couldn't be decoded
+     */
+    bool Load(size_t offset, size_t size) const;
+
     /**
      * \param address Virtual Address
-     * \return Pointer to image owned data
+     * \return Section containing the address, which bounds the data that can be accessed from it, or nullptr if unmapped
+     */
+    const Section* FindSection(size_t address) const;
+
+    /**
+     * \param address Virtual Address
+     * \return Pointer to image owned data, or nullptr if unmapped. The section containing it is decoded first when lazily loaded,
+     *         nullptr is also returned if that fails
      */
     const void* Find(size_t address) const;
 
+    /**
+     * \param address Virtual Address
+     * \param size Size of the range
+     * \return Pointer to image owned data like Find, or nullptr if the range doesn't fit entirely in the section containing the address
+     */
+    const void* Find(size_t address, size_t size) const;
+
     /**
      * \param name Name of section
-     * \return Section
+     * \return Section, decoded first when lazily loaded, or nullptr if not found or decoding fails
      */
     const Section* Find(const std::string_view& name) const;
 
@@ -41,9 +102,11 @@ struct Image
      * \brief Parse given data to an image, reallocates with ownership
      * \param data Pointer to data
      * \param size Size of data
+     * \param lazy Only decode the code sections of a XEX up front, and the other sections on first access through Find.
+     *             The data then needs to outlive the image
      * \return Parsed image
      */
-    static Image ParseImage(const uint8_t* data, size_t size);
+    static Image ParseImage(const uint8_t* data, size_t size, bool lazy = false);
 };
 
 Image ElfLoadImage(const uint8_t* data, size_t size);
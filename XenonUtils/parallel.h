@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Calls function(index) for every index in [0, count) across all hardware threads, and waits for them to finish.
+// Indices are handed out in batches of grainSize, so uneven amounts of work per index are balanced between threads.
+template<typename TFunction>
+inline void ParallelFor(size_t count, size_t grainSize, const TFunction& function)
+{
+    std::atomic<size_t> next{};
+    auto worker = [&]()
+        {
+            size_t begin;
+            while ((begin = next.fetch_add(grainSize)) < count)
+            {
+                const size_t end = std::min(begin + grainSize, count);
+                for (size_t i = begin; i < end; i++)
+                    function(i);
+            }
+        };
+
+    const size_t batchCount = (count + grainSize - 1) / grainSize;
+    const size_t threadCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), batchCount);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (auto& thread : threads)
+        thread.join();
+}
@@ -31,20 +31,34 @@
 
 #define PPC_FUNC_PROLOGUE() __builtin_assume(((size_t)base & 0x1F) == 0)
 
+// Guest memory is accessed through volatile pointers by default, so the host compiler keeps every access in program order.
+// With non-volatile memory, ordering between accesses is only enforced at the guest's memory barriers below.
+#ifdef PPC_CONFIG_NON_VOLATILE_MEMORY
+typedef uint8_t __attribute__((may_alias)) PPCMemoryU8;
+typedef uint16_t __attribute__((may_alias)) PPCMemoryU16;
+typedef uint32_t __attribute__((may_alias)) PPCMemoryU32;
+typedef uint64_t __attribute__((may_alias)) PPCMemoryU64;
+#else
+typedef volatile uint8_t PPCMemoryU8;
+typedef volatile uint16_t PPCMemoryU16;
+typedef volatile uint32_t PPCMemoryU32;
+typedef volatile uint64_t PPCMemoryU64;
+#endif
+
 #ifndef PPC_LOAD_U8
-#define PPC_LOAD_U8(x) *(volatile uint8_t*)(base + (x))
+#define PPC_LOAD_U8(x) *(PPCMemoryU8*)(base + (x))
 #endif
 
 #ifndef PPC_LOAD_U16
-#define PPC_LOAD_U16(x) __builtin_bswap16(*(volatile uint16_t*)(base + (x)))
+#define PPC_LOAD_U16(x) __builtin_bswap16(*(PPCMemoryU16*)(base + (x)))
 #endif
 
 #ifndef PPC_LOAD_U32
-#define PPC_LOAD_U32(x) __builtin_bswap32(*(volatile uint32_t*)(base + (x)))
+#define PPC_LOAD_U32(x) __builtin_bswap32(*(PPCMemoryU32*)(base + (x)))
 #endif
 
 #ifndef PPC_LOAD_U64
-#define PPC_LOAD_U64(x) __builtin_bswap64(*(volatile uint64_t*)(base + (x)))
+#define PPC_LOAD_U64(x) __builtin_bswap64(*(PPCMemoryU64*)(base + (x)))
 #endif
 
 // TODO: Implement.
@@ -68,19 +82,19 @@
 #endif
 
 #ifndef PPC_STORE_U8
-#define PPC_STORE_U8(x, y) *(volatile uint8_t*)(base + (x)) = (y)
+#define PPC_STORE_U8(x, y) *(PPCMemoryU8*)(base + (x)) = (y)
 #endif
 
 #ifndef PPC_STORE_U16
-#define PPC_STORE_U16(x, y) *(volatile uint16_t*)(base + (x)) = __builtin_bswap16(y)
+#define PPC_STORE_U16(x, y) *(PPCMemoryU16*)(base + (x)) = __builtin_bswap16(y)
 #endif
 
 #ifndef PPC_STORE_U32
-#define PPC_STORE_U32(x, y) *(volatile uint32_t*)(base + (x)) = __builtin_bswap32(y)
+#define PPC_STORE_U32(x, y) *(PPCMemoryU32*)(base + (x)) = __builtin_bswap32(y)
 #endif
 
 #ifndef PPC_STORE_U64
-#define PPC_STORE_U64(x, y) *(volatile uint64_t*)(base + (x)) = __builtin_bswap64(y)
+#define PPC_STORE_U64(x, y) *(PPCMemoryU64*)(base + (x)) = __builtin_bswap64(y)
 #endif
 
 // MMIO Store handling is completely reliant on being preeceded by eieio.
@@ -101,13 +115,62 @@
 #define PPC_MM_STORE_U64(x, y)  PPC_STORE_U64(x, y)
 #endif
 
+// Memory barriers are lowered to the weakest host fence that keeps the ordering the guest asked for.
+// sync orders everything, lwsync everything except stores before later loads, eieio stores (and MMIO),
+// and isync is used after a lock acquisition to keep later loads from being performed early.
+// x86-64 only reorders stores after later loads, so everything but sync only needs to stop the compiler.
+#if defined(__x86_64__) || defined(_M_X64)
+#ifndef PPC_FENCE_SYNC
+#define PPC_FENCE_SYNC() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#ifndef PPC_FENCE_LWSYNC
+#define PPC_FENCE_LWSYNC() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#ifndef PPC_FENCE_EIEIO
+#define PPC_FENCE_EIEIO() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#ifndef PPC_FENCE_ISYNC
+#define PPC_FENCE_ISYNC() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#ifndef PPC_FENCE_SYNC
+#define PPC_FENCE_SYNC() __asm__ __volatile__("dmb ish" ::: "memory")
+#endif
+
+#ifndef PPC_FENCE_LWSYNC
+#define PPC_FENCE_LWSYNC() __asm__ __volatile__("dmb ish" ::: "memory")
+#endif
+
+#ifndef PPC_FENCE_EIEIO
+#define PPC_FENCE_EIEIO() __asm__ __volatile__("dmb ishst" ::: "memory")
+#endif
+
+#ifndef PPC_FENCE_ISYNC
+#define PPC_FENCE_ISYNC() __asm__ __volatile__("dmb ishld" ::: "memory")
+#endif
+#else
+#   error "Missing implementation for memory barriers."
+#endif
+
 #ifndef PPC_CALL_FUNC
 #define PPC_CALL_FUNC(x) x(ctx, base)
 #endif
 
+// Body of functions that were found to be unreachable with the reachable_functions_only option.
+#ifndef PPC_UNREACHABLE_FUNC
+#define PPC_UNREACHABLE_FUNC(x) __builtin_trap()
+#endif
+
 #define PPC_MEMORY_SIZE 0x100000000ull
 
+#ifdef PPC_CONFIG_SPARSE_FUNC_TABLE
+#define PPC_LOOKUP_FUNC(x, y) PPCFuncTableLookup(uint32_t(y))
+#else
 #define PPC_LOOKUP_FUNC(x, y) *(PPCFunc**)(x + PPC_IMAGE_BASE + PPC_IMAGE_SIZE + (uint64_t(uint32_t(y) - PPC_CODE_BASE) * 2))
+#endif
 
 #ifndef PPC_CALL_INDIRECT_FUNC
 #define PPC_CALL_INDIRECT_FUNC(x) (PPC_LOOKUP_FUNC(base, x))(ctx, base)
@@ -121,8 +184,53 @@ struct PPCFuncMapping
     PPCFunc* host;
 };
 
+// Sorted by guest address with one entry per address, terminated by a null entry.
+extern const size_t PPCFuncMappingCount;
 extern PPCFuncMapping PPCFuncMappings[];
 
+inline PPCFuncMapping* PPCFuncMappingFind(size_t guest)
+{
+    size_t begin = 0;
+    size_t end = PPCFuncMappingCount;
+    while (begin < end)
+    {
+        const size_t middle = begin + (end - begin) / 2;
+        if (PPCFuncMappings[middle].guest < guest)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+
+    if (begin < PPCFuncMappingCount && PPCFuncMappings[begin].guest == guest)
+        return &PPCFuncMappings[begin];
+
+    return nullptr;
+}
+
+#ifdef PPC_CONFIG_SPARSE_FUNC_TABLE
+// Every 64 instructions of the code range share a bit mask of function entries
+// and the index of their first entry, so a lookup is a rank query into the
+// entry array instead of a load from a table twice the size of the code.
+extern PPCFunc* PPCFuncTableEntries[];
+extern const uint64_t PPCFuncTableBits[];
+extern const uint32_t PPCFuncTableRanks[];
+
+inline PPCFunc* PPCFuncTableLookup(uint32_t guest)
+{
+    const uint32_t offset = guest - uint32_t(PPC_CODE_BASE);
+    if (offset >= uint32_t(PPC_CODE_SIZE)) [[unlikely]]
+        return nullptr;
+
+    const uint32_t index = offset >> 2;
+    const uint64_t bits = PPCFuncTableBits[index >> 6];
+    const uint64_t mask = 1ull << (index & 63);
+    if ((bits & mask) == 0) [[unlikely]]
+        return nullptr;
+
+    return PPCFuncTableEntries[PPCFuncTableRanks[index >> 6] + __builtin_popcountll(bits & (mask - 1))];
+}
+#endif
+
 union PPCRegister
 {
     int8_t s8;
@@ -301,16 +409,13 @@ struct PPCFPSCRRegister
     }
 };
 
+// Members are ordered by how often recompiled code touches them, so that the
+// stack pointer, argument registers and condition fields of a typical function
+// share the first few cache lines, with the rarely used vector registers last.
 struct alignas(0x40) PPCContext
 {
-    PPCRegister r3;
-#ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
-    PPCRegister r0;
-#endif
     PPCRegister r1;
-#ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
-    PPCRegister r2;
-#endif
+    PPCRegister r3;
     PPCRegister r4;
     PPCRegister r5;
     PPCRegister r6;
@@ -319,31 +424,20 @@ struct alignas(0x40) PPCContext
     PPCRegister r9;
     PPCRegister r10;
 #ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
+    PPCRegister r0;
     PPCRegister r11;
     PPCRegister r12;
 #endif
-    PPCRegister r13;
-#ifndef PPC_CONFIG_NON_VOLATILE_AS_LOCAL
-    PPCRegister r14;
-    PPCRegister r15;
-    PPCRegister r16;
-    PPCRegister r17;
-    PPCRegister r18;
-    PPCRegister r19;
-    PPCRegister r20;
-    PPCRegister r21;
-    PPCRegister r22;
-    PPCRegister r23;
-    PPCRegister r24;
-    PPCRegister r25;
-    PPCRegister r26;
-    PPCRegister r27;
-    PPCRegister r28;
-    PPCRegister r29;
-    PPCRegister r30;
-    PPCRegister r31;
+#ifndef PPC_CONFIG_CR_AS_LOCAL
+    PPCCRRegister cr0;
+    PPCCRRegister cr6;
+    PPCCRRegister cr1;
+    PPCCRRegister cr2;
+    PPCCRRegister cr3;
+    PPCCRRegister cr4;
+    PPCCRRegister cr5;
+    PPCCRRegister cr7;
 #endif
-
 #ifndef PPC_CONFIG_SKIP_LR
     uint64_t lr;
 #endif
@@ -353,27 +447,39 @@ struct alignas(0x40) PPCContext
 #ifndef PPC_CONFIG_XER_AS_LOCAL
     PPCXERRegister xer;
 #endif
+    PPCFPSCRRegister fpscr;
+
+#ifndef PPC_CONFIG_NON_VOLATILE_AS_LOCAL
+    PPCRegister r31;
+    PPCRegister r30;
+    PPCRegister r29;
+    PPCRegister r28;
+    PPCRegister r27;
+    PPCRegister r26;
+    PPCRegister r25;
+    PPCRegister r24;
+    PPCRegister r23;
+    PPCRegister r22;
+    PPCRegister r21;
+    PPCRegister r20;
+    PPCRegister r19;
+    PPCRegister r18;
+    PPCRegister r17;
+    PPCRegister r16;
+    PPCRegister r15;
+    PPCRegister r14;
+#endif
+#ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
+    PPCRegister r2;
+#endif
+    PPCRegister r13;
 #ifndef PPC_CONFIG_RESERVED_AS_LOCAL
     PPCRegister reserved;
 #endif
 #ifndef PPC_CONFIG_SKIP_MSR
     uint32_t msr = 0x200A000;
 #endif
-#ifndef PPC_CONFIG_CR_AS_LOCAL
-    PPCCRRegister cr0;
-    PPCCRRegister cr1;
-    PPCCRRegister cr2;
-    PPCCRRegister cr3;
-    PPCCRRegister cr4;
-    PPCCRRegister cr5;
-    PPCCRRegister cr6;
-    PPCCRRegister cr7;
-#endif
-    PPCFPSCRRegister fpscr;
 
-#ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
-    PPCRegister f0;
-#endif
     PPCRegister f1;
     PPCRegister f2;
     PPCRegister f3;
@@ -387,25 +493,28 @@ struct alignas(0x40) PPCContext
     PPCRegister f11;
     PPCRegister f12;
     PPCRegister f13;
+#ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
+    PPCRegister f0;
+#endif
 #ifndef PPC_CONFIG_NON_VOLATILE_AS_LOCAL
-    PPCRegister f14;
-    PPCRegister f15;
-    PPCRegister f16;
-    PPCRegister f17;
-    PPCRegister f18;
-    PPCRegister f19;
-    PPCRegister f20;
-    PPCRegister f21;
-    PPCRegister f22;
-    PPCRegister f23;
-    PPCRegister f24;
-    PPCRegister f25;
-    PPCRegister f26;
-    PPCRegister f27;
-    PPCRegister f28;
-    PPCRegister f29;
-    PPCRegister f30;
     PPCRegister f31;
+    PPCRegister f30;
+    PPCRegister f29;
+    PPCRegister f28;
+    PPCRegister f27;
+    PPCRegister f26;
+    PPCRegister f25;
+    PPCRegister f24;
+    PPCRegister f23;
+    PPCRegister f22;
+    PPCRegister f21;
+    PPCRegister f20;
+    PPCRegister f19;
+    PPCRegister f18;
+    PPCRegister f17;
+    PPCRegister f16;
+    PPCRegister f15;
+    PPCRegister f14;
 #endif
 
     PPCVRegister v0;
@@ -422,26 +531,6 @@ struct alignas(0x40) PPCContext
     PPCVRegister v11;
     PPCVRegister v12;
     PPCVRegister v13;
-#ifndef PPC_CONFIG_NON_VOLATILE_AS_LOCAL
-    PPCVRegister v14;
-    PPCVRegister v15;
-    PPCVRegister v16;
-    PPCVRegister v17;
-    PPCVRegister v18;
-    PPCVRegister v19;
-    PPCVRegister v20;
-    PPCVRegister v21;
-    PPCVRegister v22;
-    PPCVRegister v23;
-    PPCVRegister v24;
-    PPCVRegister v25;
-    PPCVRegister v26;
-    PPCVRegister v27;
-    PPCVRegister v28;
-    PPCVRegister v29;
-    PPCVRegister v30;
-    PPCVRegister v31;
-#endif
 #ifndef PPC_CONFIG_NON_ARGUMENT_AS_LOCAL
     PPCVRegister v32;
     PPCVRegister v33;
@@ -476,6 +565,26 @@ struct alignas(0x40) PPCContext
     PPCVRegister v62;
     PPCVRegister v63;
 #endif
+#ifndef PPC_CONFIG_NON_VOLATILE_AS_LOCAL
+    PPCVRegister v14;
+    PPCVRegister v15;
+    PPCVRegister v16;
+    PPCVRegister v17;
+    PPCVRegister v18;
+    PPCVRegister v19;
+    PPCVRegister v20;
+    PPCVRegister v21;
+    PPCVRegister v22;
+    PPCVRegister v23;
+    PPCVRegister v24;
+    PPCVRegister v25;
+    PPCVRegister v26;
+    PPCVRegister v27;
+    PPCVRegister v28;
+    PPCVRegister v29;
+    PPCVRegister v30;
+    PPCVRegister v31;
+#endif
 #ifndef PPC_CONFIG_NON_VOLATILE_AS_LOCAL
     PPCVRegister v64;
     PPCVRegister v65;
@@ -0,0 +1,154 @@
+#include "sha1.h"
+#include <cstring>
+#include <utility>
+#include <TinySHA1.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#   define SHA1_X86
+#   include <immintrin.h>
+#   if defined(_WIN32)
+#       include <intrin.h>
+#   else
+#       include <cpuid.h>
+#   endif
+#endif
+
+#if defined(SHA1_X86)
+
+static bool HasShaInstructions()
+{
+#if defined(_WIN32)
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 0);
+    if (cpuInfo[0] < 7)
+        return false;
+
+    __cpuidex(cpuInfo, 7, 0);
+    return (cpuInfo[1] & (1 << 29)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA) != 0;
+#endif
+}
+
+// Four rounds of SHA-1, with the message schedule of the following rounds interleaved.
+// E alternates between e0 and e1, and the message words rotate through msg.
+template<int Group>
+__attribute__((target("sha,sse4.1"), always_inline))
+static inline void Sha1RoundGroup(__m128i& abcd, __m128i& e0, __m128i& e1, __m128i (&msg)[4])
+{
+    __m128i& w = msg[Group % 4];
+    __m128i& e = Group % 2 == 0 ? e0 : e1;
+    __m128i& nextE = Group % 2 == 0 ? e1 : e0;
+
+    if constexpr (Group == 0)
+        e = _mm_add_epi32(e, w);
+    else
+        e = _mm_sha1nexte_epu32(e, w);
+
+    nextE = abcd;
+
+    if constexpr (Group >= 3 && Group <= 18)
+        msg[(Group + 1) % 4] = _mm_sha1msg2_epu32(msg[(Group + 1) % 4], w);
+
+    abcd = _mm_sha1rnds4_epu32(abcd, e, Group / 5);
+
+    if constexpr (Group >= 1 && Group <= 16)
+        msg[(Group + 3) % 4] = _mm_sha1msg1_epu32(msg[(Group + 3) % 4], w);
+
+    if constexpr (Group >= 2 && Group <= 17)
+        msg[(Group + 2) % 4] = _mm_xor_si128(msg[(Group + 2) % 4], w);
+}
+
+template<int... Groups>
+__attribute__((target("sha,sse4.1"), always_inline))
+static inline void Sha1Rounds(__m128i& abcd, __m128i& e0, __m128i& e1, __m128i (&msg)[4], std::integer_sequence<int, Groups...>)
+{
+    (Sha1RoundGroup<Groups>(abcd, e0, e1, msg), ...);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void Sha1ProcessBlocksHardware(uint32_t (&state)[5], const uint8_t* data, size_t blockCount)
+{
+    const __m128i byteSwapMask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (size_t i = 0; i < blockCount; i++)
+    {
+        const __m128i abcdSave = abcd;
+        const __m128i e0Save = e0;
+        __m128i e1;
+        __m128i msg[4];
+
+        for (size_t j = 0; j < 4; j++)
+            msg[j] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 64 + j * 16)), byteSwapMask);
+
+        Sha1Rounds(abcd, e0, e1, msg, std::make_integer_sequence<int, 20>());
+
+        e0 = _mm_sha1nexte_epu32(e0, e0Save);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static void Sha1DigestInstructions(const void* data, size_t size, uint8_t (&digest)[20])
+{
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    const size_t blockCount = size / 64;
+    Sha1ProcessBlocksHardware(state, static_cast<const uint8_t*>(data), blockCount);
+
+    // Pad the remaining bytes into one or two final blocks.
+    uint8_t tail[128]{};
+    const size_t tailSize = size % 64;
+    memcpy(tail, static_cast<const uint8_t*>(data) + blockCount * 64, tailSize);
+    tail[tailSize] = 0x80;
+
+    const size_t tailBlockCount = tailSize < 56 ? 1 : 2;
+    const uint64_t bitCount = uint64_t(size) * 8;
+    for (size_t i = 0; i < 8; i++)
+        tail[tailBlockCount * 64 - 1 - i] = uint8_t(bitCount >> (i * 8));
+
+    Sha1ProcessBlocksHardware(state, tail, tailBlockCount);
+
+    for (size_t i = 0; i < 5; i++)
+    {
+        digest[i * 4 + 0] = uint8_t(state[i] >> 24);
+        digest[i * 4 + 1] = uint8_t(state[i] >> 16);
+        digest[i * 4 + 2] = uint8_t(state[i] >> 8);
+        digest[i * 4 + 3] = uint8_t(state[i]);
+    }
+}
+
+#endif
+
+void Sha1DigestPortable(const void* data, size_t size, uint8_t (&digest)[20])
+{
+    sha1::SHA1 s;
+    s.processBytes(data, size);
+    s.finalize(digest);
+}
+
+bool Sha1DigestHardware(const void* data, size_t size, uint8_t (&digest)[20])
+{
+#if defined(SHA1_X86)
+    static const bool hasShaInstructions = HasShaInstructions();
+    if (hasShaInstructions)
+    {
+        Sha1DigestInstructions(data, size, digest);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+void Sha1Digest(const void* data, size_t size, uint8_t (&digest)[20])
+{
+    if (!Sha1DigestHardware(data, size, digest))
+        Sha1DigestPortable(data, size, digest);
+}
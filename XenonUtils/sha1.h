@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Computes the SHA-1 digest of data, using the SHA instructions of the host CPU when they are available.
+void Sha1Digest(const void* data, size_t size, uint8_t (&digest)[20]);
+
+// The two implementations Sha1Digest picks from, exposed so they can be checked against each other.
+// Sha1DigestHardware returns false without writing the digest if the host CPU has no SHA instructions.
+void Sha1DigestPortable(const void* data, size_t size, uint8_t (&digest)[20]);
+bool Sha1DigestHardware(const void* data, size_t size, uint8_t (&digest)[20]);
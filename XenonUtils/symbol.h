@@ -1,7 +1,13 @@
 #pragma once
+#include <charconv>
+#include <cstring>
 #include <string>
+#include <string_view>
 #include <cstdint>
 
+// Large enough for a name rendered from an address, sub_ followed by up to 16 hex digits.
+inline constexpr size_t SYMBOL_NAME_BUFFER_SIZE = 24;
+
 enum SymbolType
 {
     Symbol_None,
@@ -12,6 +18,7 @@ enum SymbolType
 
 struct Symbol
 {
+    // Left empty for symbols named after their address, which get their name rendered by GetName.
     mutable std::string name{};
     size_t address{};
     size_t size{};
@@ -25,6 +32,36 @@ struct Symbol
         : name(std::move(name)), address(address), size(size), type(type)
     {
     }
+
+    Symbol(size_t address, size_t size, SymbolType type)
+        : address(address), size(size), type(type)
+    {
+    }
+
+    // Renders sub_<address> into the buffer unless the symbol has a name of its own.
+    std::string_view GetName(char (&buffer)[SYMBOL_NAME_BUFFER_SIZE]) const
+    {
+        if (!name.empty())
+        {
+            return name;
+        }
+
+        memcpy(buffer, "sub_", 4);
+        char* end = std::to_chars(buffer + 4, buffer + SYMBOL_NAME_BUFFER_SIZE, address, 16).ptr;
+        for (char* c = buffer + 4; c < end; c++)
+        {
+            if (*c >= 'a' && *c <= 'f')
+                *c -= 'a' - 'A';
+        }
+
+        return { buffer, size_t(end - buffer) };
+    }
+
+    std::string GetName() const
+    {
+        char buffer[SYMBOL_NAME_BUFFER_SIZE];
+        return std::string(GetName(buffer));
+    }
 };
 
 struct SymbolComparer
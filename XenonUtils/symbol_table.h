@@ -1,63 +1,132 @@
 #pragma once
 #include "symbol.h"
-#include <set>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
 
-class SymbolTable : public std::multiset<Symbol, SymbolComparer>
+// Symbols sorted by address in a flat array, symbols sharing an address keep their insertion order.
+// Adding symbols in address order only appends, and unordered symbols can be added in batches to move the table once.
+class SymbolTable
 {
 public:
+    using iterator = std::vector<Symbol>::iterator;
+    using const_iterator = std::vector<Symbol>::const_iterator;
+
+    iterator begin() { return symbols.begin(); }
+    iterator end() { return symbols.end(); }
+    const_iterator begin() const { return symbols.begin(); }
+    const_iterator end() const { return symbols.end(); }
+
+    size_t size() const { return symbols.size(); }
+    bool empty() const { return symbols.empty(); }
+
+    void reserve(size_t count)
+    {
+        symbols.reserve(count);
+    }
+
+    template<class... Args>
+    iterator emplace(Args&&... args)
+    {
+        return insert(Symbol(std::forward<Args>(args)...));
+    }
+
+    iterator insert(Symbol symbol)
+    {
+        maxSize = std::max(maxSize, symbol.size);
+        const auto it = upper_bound(symbol.address);
+        return symbols.insert(it, std::move(symbol));
+    }
+
+    void insert(std::vector<Symbol>&& batch)
+    {
+        const size_t count = symbols.size();
+        for (const auto& symbol : batch)
+            maxSize = std::max(maxSize, symbol.size);
+
+        std::stable_sort(batch.begin(), batch.end(), SymbolComparer());
+        symbols.insert(symbols.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+        std::inplace_merge(symbols.begin(), symbols.begin() + count, symbols.end(), SymbolComparer());
+        batch.clear();
+    }
+
+    // Changes the size of a symbol without moving it, its address and so its place in the table stay the same.
+    void setSize(const_iterator it, size_t size)
+    {
+        maxSize = std::max(maxSize, size);
+        symbols[it - symbols.cbegin()].size = size;
+    }
+
+    iterator erase(const_iterator it)
+    {
+        return symbols.erase(it);
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        return symbols.erase(first, last);
+    }
+
+    iterator lower_bound(size_t address) { return std::lower_bound(symbols.begin(), symbols.end(), address, SymbolComparer()); }
+    iterator upper_bound(size_t address) { return std::upper_bound(symbols.begin(), symbols.end(), address, SymbolComparer()); }
+    const_iterator lower_bound(size_t address) const { return std::lower_bound(symbols.begin(), symbols.end(), address, SymbolComparer()); }
+    const_iterator upper_bound(size_t address) const { return std::upper_bound(symbols.begin(), symbols.end(), address, SymbolComparer()); }
+
+    std::pair<iterator, iterator> equal_range(size_t address)
+    {
+        return std::equal_range(symbols.begin(), symbols.end(), address, SymbolComparer());
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(size_t address) const
+    {
+        return std::equal_range(symbols.begin(), symbols.end(), address, SymbolComparer());
+    }
+
+    // Finds the last symbol added at the address that isn't empty.
     const_iterator find(size_t address) const
     {
         auto [beginIt, endIt] = equal_range(address);
-        if (beginIt == endIt)
-        {
-            return end();
-        }
-
-        size_t closest{ address - beginIt->address };
-        auto match = end();
-        for (auto it = beginIt; it != endIt; ++it)
+        for (auto it = endIt; it != beginIt;)
         {
-            if (address < it->address || address >= it->address + it->size)
-            {
-                continue;
-            }
-
-            const size_t distance = address - it->address;
-            if (distance <= closest)
+            --it;
+            if (it->size != 0)
             {
-                match = it;
-                closest = distance;
+                return it;
             }
         }
 
-        return match;
+        return end();
     }
 
     iterator find(size_t address)
     {
-        auto [beginIt, endIt] = equal_range(address);
-        if (beginIt == endIt)
-        {
-            return end();
-        }
+        const auto it = std::as_const(*this).find(address);
+        return symbols.begin() + (it - symbols.cbegin());
+    }
 
-        size_t closest{ address - beginIt->address };
-        auto match = end();
-        for (auto it = beginIt; it != endIt; ++it)
+    // Finds the closest symbol starting at or before the address whose range contains it.
+    const_iterator findContaining(size_t address) const
+    {
+        for (auto it = upper_bound(address); it != begin();)
         {
-            if (address < it->address || address >= it->address + it->size)
+            --it;
+            if (address < it->address + it->size)
             {
-                continue;
+                return it;
             }
 
-            const size_t distance = address - it->address;
-            if (distance <= closest)
+            // Symbols further back than the size of the largest one can't reach the address.
+            if (it->address + maxSize <= address)
             {
-                match = it;
-                closest = distance;
+                break;
             }
         }
 
-        return match;
+        return end();
     }
+
+private:
+    std::vector<Symbol> symbols;
+    size_t maxSize{};
 };
@@ -1,4 +1,10 @@
 #include "xdbf_wrapper.h"
+#include <algorithm>
+
+static bool CompareResources(const XDBFResource& lhs, const XDBFResource& rhs)
+{
+    return lhs.NamespaceID < rhs.NamespaceID || (lhs.NamespaceID == rhs.NamespaceID && lhs.ResourceID < rhs.ResourceID);
+}
 
 XDBFWrapper::XDBFWrapper(const uint8_t* buffer, size_t bufferSize) : pBuffer(buffer), BufferSize(bufferSize)
 {
@@ -26,127 +32,155 @@ XDBFWrapper::XDBFWrapper(const uint8_t* buffer, size_t bufferSize) : pBuffer(buf
     seek += sizeof(XDBFFreeSpaceEntry) * pHeader->FreeSpaceTableLength;
 
     pContent = seek;
-}
 
-XDBFBlock XDBFWrapper::GetResource(EXDBFNamespace ns, uint64_t id) const
-{
-    for (int i = 0; i < pHeader->EntryCount; i++)
+    // Entries sharing a namespace and ID keep their order, so the first one is still the one found.
+    Resources.reserve(pHeader->EntryCount);
+    for (size_t i = 0; i < pHeader->EntryCount; i++)
     {
         auto& entry = pEntries[i];
-
-        if (entry.NamespaceID == ns && entry.ResourceID == id)
-        {
-            XDBFBlock block{};
-            block.pBuffer = pContent + entry.Offset;
-            block.BufferSize = entry.Length;
-            return block;
-        }
+        Resources.push_back({ entry.NamespaceID.get(), entry.ResourceID, { pContent + entry.Offset, entry.Length } });
     }
 
-    return { nullptr };
-}
+    std::stable_sort(Resources.begin(), Resources.end(), CompareResources);
 
-std::string XDBFWrapper::GetString(EXDBFLanguage language, uint16_t id) const
-{
-    auto languageBlock = GetResource(XDBF_SPA_NAMESPACE_STRING_TABLE, (uint64_t)language);
-
-    if (!languageBlock)
-        return "";
+    for (size_t i = 0; i < Resources.size(); i++)
+    {
+        auto& resource = Resources[i];
+        if (resource.NamespaceID != XDBF_SPA_NAMESPACE_STRING_TABLE || resource.ResourceID > UINT32_MAX)
+            continue;
 
-    auto pHeader = (XSTRHeader*)languageBlock.pBuffer;
-    auto seek = languageBlock.pBuffer + sizeof(XSTRHeader);
+        if (i != 0 && Resources[i - 1].NamespaceID == resource.NamespaceID && Resources[i - 1].ResourceID == resource.ResourceID)
+            continue;
 
-    for (int i = 0; i < pHeader->StringCount; i++)
-    {
-        auto entry = (XSTREntry*)seek;
+        auto pStringHeader = (XSTRHeader*)resource.Block.pBuffer;
+        auto seek = resource.Block.pBuffer + sizeof(XSTRHeader);
+        auto end = resource.Block.pBuffer + resource.Block.BufferSize;
 
-        seek += sizeof(XSTREntry);
+        for (size_t j = 0; j < pStringHeader->StringCount && seek + sizeof(XSTREntry) <= end; j++)
+        {
+            auto entry = (XSTREntry*)seek;
+            seek += sizeof(XSTREntry);
 
-        if (entry->ID == id)
-            return std::string((const char*)seek, entry->Length);
+            if (entry->Length > size_t(end - seek))
+                break;
 
-        seek += entry->Length;
+            Strings.emplace((resource.ResourceID << 16) | entry->ID, std::string_view((const char*)seek, entry->Length));
+            seek += entry->Length;
+        }
     }
 
-    return "";
+    auto achievementsBlock = GetResource(XDBF_SPA_NAMESPACE_METADATA, XACH_SIGNATURE);
+    if (achievementsBlock)
+    {
+        auto pAchievementHeader = (XACHHeader*)achievementsBlock.pBuffer;
+        auto seek = achievementsBlock.pBuffer + sizeof(XACHHeader);
+
+        AchievementEntries.reserve(pAchievementHeader->AchievementCount);
+        for (size_t i = 0; i < pAchievementHeader->AchievementCount; i++)
+        {
+            auto entry = (XACHEntry*)seek;
+            seek += sizeof(XACHEntry);
+
+            AchievementEntries.push_back(entry);
+            AchievementEntriesByID.emplace(entry->AchievementID, entry);
+        }
+    }
 }
 
-std::vector<Achievement> XDBFWrapper::GetAchievements(EXDBFLanguage language) const
+XDBFBlock XDBFWrapper::GetResource(EXDBFNamespace ns, uint64_t id) const
 {
-    std::vector<Achievement> result;
+    const XDBFResource key{ ns, id };
+    auto it = std::lower_bound(Resources.begin(), Resources.end(), key, CompareResources);
 
-    auto achievementsBlock = GetResource(XDBF_SPA_NAMESPACE_METADATA, XACH_SIGNATURE);
-
-    if (!achievementsBlock)
-        return result;
+    if (it == Resources.end() || it->NamespaceID != ns || it->ResourceID != id)
+        return { nullptr };
 
-    auto pHeader = (XACHHeader*)achievementsBlock.pBuffer;
-    auto seek = achievementsBlock.pBuffer + sizeof(XACHHeader);
+    return it->Block;
+}
 
-    for (int i = 0; i < pHeader->AchievementCount; i++)
-    {
-        auto entry = (XACHEntry*)seek;
+std::string_view XDBFWrapper::GetStringView(EXDBFLanguage language, uint16_t id) const
+{
+    auto it = Strings.find((uint64_t(language) << 16) | id);
+    if (it == Strings.end())
+        return {};
 
-        seek += sizeof(XACHEntry);
+    return it->second;
+}
 
-        Achievement achievement{};
-        achievement.ID = entry->AchievementID;
-        achievement.Name = GetString(language, entry->NameID);
-        achievement.UnlockedDesc = GetString(language, entry->UnlockedDescID);
-        achievement.LockedDesc = GetString(language, entry->LockedDescID);
-        achievement.Score = entry->Gamerscore;
+std::string XDBFWrapper::GetString(EXDBFLanguage language, uint16_t id) const
+{
+    return std::string(GetStringView(language, id));
+}
 
-        auto imageBlock = GetResource(XDBF_SPA_NAMESPACE_IMAGE, entry->ImageID);
+static AchievementView MakeAchievementView(const XDBFWrapper& wrapper, EXDBFLanguage language, const XACHEntry& entry)
+{
+    AchievementView achievement{};
+    achievement.ID = entry.AchievementID;
+    achievement.Name = wrapper.GetStringView(language, entry.NameID);
+    achievement.UnlockedDesc = wrapper.GetStringView(language, entry.UnlockedDescID);
+    achievement.LockedDesc = wrapper.GetStringView(language, entry.LockedDescID);
+    achievement.Score = entry.Gamerscore;
 
-        if (imageBlock)
-        {
-            achievement.pImageBuffer = imageBlock.pBuffer;
-            achievement.ImageBufferSize = imageBlock.BufferSize;
-        }
+    auto imageBlock = wrapper.GetResource(XDBF_SPA_NAMESPACE_IMAGE, entry.ImageID);
 
-        result.push_back(achievement);
+    if (imageBlock)
+    {
+        achievement.pImageBuffer = imageBlock.pBuffer;
+        achievement.ImageBufferSize = imageBlock.BufferSize;
     }
 
-    return result;
+    return achievement;
 }
 
-Achievement XDBFWrapper::GetAchievement(EXDBFLanguage language, uint16_t id) const
+static Achievement MakeAchievement(const AchievementView& view)
 {
-    Achievement result{};
+    Achievement achievement{};
+    achievement.ID = view.ID;
+    achievement.Name = std::string(view.Name);
+    achievement.UnlockedDesc = std::string(view.UnlockedDesc);
+    achievement.LockedDesc = std::string(view.LockedDesc);
+    achievement.pImageBuffer = view.pImageBuffer;
+    achievement.ImageBufferSize = view.ImageBufferSize;
+    achievement.Score = view.Score;
+    return achievement;
+}
 
-    auto achievementsBlock = GetResource(XDBF_SPA_NAMESPACE_METADATA, 0x58414348);
+std::vector<AchievementView> XDBFWrapper::GetAchievementViews(EXDBFLanguage language) const
+{
+    std::vector<AchievementView> result;
+    result.reserve(AchievementEntries.size());
 
-    if (!achievementsBlock)
-        return result;
+    for (auto entry : AchievementEntries)
+        result.push_back(MakeAchievementView(*this, language, *entry));
 
-    auto pHeader = (XACHHeader*)achievementsBlock.pBuffer;
-    auto seek = achievementsBlock.pBuffer + sizeof(XACHHeader);
+    return result;
+}
 
-    for (int i = 0; i < pHeader->AchievementCount; i++)
-    {
-        auto entry = (XACHEntry*)seek;
+AchievementView XDBFWrapper::GetAchievementView(EXDBFLanguage language, uint16_t id) const
+{
+    auto it = AchievementEntriesByID.find(id);
+    if (it == AchievementEntriesByID.end())
+        return {};
 
-        seek += sizeof(XACHEntry);
+    return MakeAchievementView(*this, language, *it->second);
+}
 
-        if (entry->AchievementID == id)
-        {
-            result.ID = entry->AchievementID;
-            result.Name = GetString(language, entry->NameID);
-            result.UnlockedDesc = GetString(language, entry->UnlockedDescID);
-            result.LockedDesc = GetString(language, entry->LockedDescID);
-            result.Score = entry->Gamerscore;
+std::vector<Achievement> XDBFWrapper::GetAchievements(EXDBFLanguage language) const
+{
+    std::vector<Achievement> result;
+    result.reserve(AchievementEntries.size());
 
-            auto imageBlock = GetResource(XDBF_SPA_NAMESPACE_IMAGE, entry->ImageID);
+    for (auto entry : AchievementEntries)
+        result.push_back(MakeAchievement(MakeAchievementView(*this, language, *entry)));
 
-            if (imageBlock)
-            {
-                result.pImageBuffer = imageBlock.pBuffer;
-                result.ImageBufferSize = imageBlock.BufferSize;
-            }
+    return result;
+}
 
-            return result;
-        }
-    }
+Achievement XDBFWrapper::GetAchievement(EXDBFLanguage language, uint16_t id) const
+{
+    auto it = AchievementEntriesByID.find(id);
+    if (it == AchievementEntriesByID.end())
+        return {};
 
-    return result;
+    return MakeAchievement(MakeAchievementView(*this, language, *it->second));
 }
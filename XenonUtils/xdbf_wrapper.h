@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include "xdbf.h"
 
@@ -14,6 +17,18 @@ struct Achievement
     uint16_t Score;
 };
 
+// Same as Achievement, with the strings pointing into the XDBF buffer instead of being copied.
+struct AchievementView
+{
+    uint16_t ID;
+    std::string_view Name;
+    std::string_view UnlockedDesc;
+    std::string_view LockedDesc;
+    const uint8_t* pImageBuffer;
+    size_t ImageBufferSize;
+    uint16_t Score;
+};
+
 struct XDBFBlock
 {
     const uint8_t* pBuffer;
@@ -25,6 +40,13 @@ struct XDBFBlock
     }
 };
 
+struct XDBFResource
+{
+    uint16_t NamespaceID;
+    uint64_t ResourceID;
+    XDBFBlock Block;
+};
+
 class XDBFWrapper
 {
 public:
@@ -37,10 +59,19 @@ public:
     const XDBFEntry* pEntries;
     const XDBFFreeSpaceEntry* pFiles;
 
+    // Built once on construction, so lookups don't have to walk the entry, string and achievement tables.
+    std::vector<XDBFResource> Resources; // Sorted by namespace and ID
+    std::unordered_map<uint64_t, std::string_view> Strings; // Keyed by language << 16 | string ID
+    std::vector<const XACHEntry*> AchievementEntries;
+    std::unordered_map<uint16_t, const XACHEntry*> AchievementEntriesByID;
+
     XDBFWrapper() {}
     XDBFWrapper(const uint8_t* pBuffer, size_t bufferSize);
     XDBFBlock GetResource(EXDBFNamespace ns, uint64_t id) const;
+    std::string_view GetStringView(EXDBFLanguage language, uint16_t id) const;
     std::string GetString(EXDBFLanguage language, uint16_t id) const;
+    std::vector<AchievementView> GetAchievementViews(EXDBFLanguage language) const;
+    AchievementView GetAchievementView(EXDBFLanguage language, uint16_t id) const;
     std::vector<Achievement> GetAchievements(EXDBFLanguage language) const;
     Achievement GetAchievement(EXDBFLanguage language, uint16_t id) const;
 };
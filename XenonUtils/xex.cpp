@@ -1,11 +1,15 @@
 #include "xex.h"
 #include "image.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <vector>
 #include <unordered_map>
 #include <aes.hpp>
-#include <TinySHA1.hpp>
+#include <aes_cbc.h>
+#include <parallel.h>
+#include <sha1.h>
 #include <xex_patcher.h>
 
 #define STRINGIFY(X) #X
@@ -124,7 +128,222 @@ std::unordered_map<size_t, const char*> XboxKernelExports =
     #include "xbox/xboxkrnl_table.inc"
 };
 
-Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
+bool Xex2FindCompressedChunks(const Xex2CompressedBlockInfo& firstBlock, const uint8_t* data, size_t dataSize, std::vector<LzxChunk>& chunks)
+{
+    struct Block
+    {
+        size_t offset;
+        Xex2CompressedBlockInfo info;
+    };
+
+    // Every block starts with the size and hash of the next one, so the chain can be walked up front and the blocks verified in parallel.
+    std::vector<Block> blocks;
+    Xex2CompressedBlockInfo block = firstBlock;
+    size_t offset = 0;
+
+    while (block.blockSize)
+    {
+        if (block.blockSize < sizeof(Xex2CompressedBlockInfo) || block.blockSize > dataSize - offset)
+            return false;
+
+        blocks.push_back({ offset, block });
+        block = *reinterpret_cast<const Xex2CompressedBlockInfo*>(data + offset);
+        offset += blocks.back().info.blockSize;
+    }
+
+    std::atomic<bool> valid = true;
+    ParallelFor(blocks.size(), 1, [&](size_t index)
+        {
+            uint8_t digest[0x14];
+            Sha1Digest(data + blocks[index].offset, blocks[index].info.blockSize, digest);
+
+            if (memcmp(digest, blocks[index].info.blockHash, sizeof(digest)) != 0)
+                valid = false;
+        });
+
+    if (!valid)
+        return false;
+
+    chunks.clear();
+    for (const auto& block : blocks)
+    {
+        const uint8_t* p = data + block.offset + sizeof(Xex2CompressedBlockInfo);
+        const uint8_t* end = data + block.offset + block.info.blockSize;
+
+        while (end - p >= 2)
+        {
+            const size_t chunkSize = (p[0] << 8) | p[1];
+            p += 2;
+
+            if (!chunkSize)
+                break;
+
+            if (chunkSize > size_t(end - p))
+                return false;
+
+            chunks.push_back({ p, chunkSize });
+            p += chunkSize;
+        }
+    }
+
+    return true;
+}
+
+// Decodes the payload of a XEX on first access, reading straight from the input file unless it needs decrypting up front.
+struct Xex2ImageLoader : ImageLoader
+{
+    struct BasicBlock
+    {
+        size_t srcOffset;
+        size_t destOffset;
+        size_t dataSize;
+        size_t zeroSize;
+    };
+
+    uint32_t compressionType{};
+    const uint8_t* payload{};
+    size_t payloadSize{};
+    bool encrypted{};
+    uint8_t key[16]{};
+
+    std::vector<BasicBlock> basicBlocks;
+
+    std::unique_ptr<uint8_t[]> decryptedPayload;
+    std::vector<LzxChunk> chunks;
+    LzxStream* lzxStream{};
+    size_t lzxOffset{};
+
+    using ImageLoader::ImageLoader;
+
+    ~Xex2ImageLoader() override
+    {
+        if (lzxStream != nullptr)
+            lzxStreamDestroy(lzxStream);
+    }
+
+    // Copies a range of the payload, decrypting it if necessary. Anything past the end of the payload is zeroed.
+    void ReadPayload(uint8_t* dest, size_t offset, size_t size) const
+    {
+        const size_t available = offset < payloadSize ? std::min(size, payloadSize - offset) : 0;
+        memset(dest + available, 0, size - available);
+
+        if (!encrypted)
+        {
+            memcpy(dest, payload + offset, available);
+            return;
+        }
+
+        if (available == 0)
+            return;
+
+        // A CBC block only depends on the cipher block before it, so any range of whole blocks can be decrypted on its own.
+        const size_t alignedBegin = offset & ~size_t(15);
+        const size_t alignedEnd = std::min((offset + available + 15) & ~size_t(15), payloadSize);
+
+        std::vector<uint8_t> buffer(payload + alignedBegin, payload + alignedEnd);
+        AesCbcDecrypt(key, alignedBegin == 0 ? AESBlankIV : payload + alignedBegin - 16, buffer.data(), buffer.size());
+        memcpy(dest, buffer.data() + (offset - alignedBegin), available);
+    }
+
+    bool Decode(uint8_t* data, size_t& begin, size_t end) override
+    {
+        if (compressionType == XEX_COMPRESSION_NONE)
+        {
+            ReadPayload(data + begin, begin, end - begin);
+        }
+        else if (compressionType == XEX_COMPRESSION_BASIC)
+        {
+            memset(data + begin, 0, end - begin);
+
+            for (const auto& block : basicBlocks)
+            {
+                const size_t blockBegin = std::max(begin, block.destOffset);
+                const size_t blockEnd = std::min(end, block.destOffset + block.dataSize);
+                if (blockBegin < blockEnd)
+                    ReadPayload(data + blockBegin, block.srcOffset + (blockBegin - block.destOffset), blockEnd - blockBegin);
+            }
+        }
+        else if (compressionType == XEX_COMPRESSION_NORMAL)
+        {
+            // LZX can only be decoded from the start, so everything up to the end of the range gets decoded.
+            // A corrupted stream can't be resumed, so a failure leaves the rest of the image undecoded.
+            begin = lzxOffset;
+            if (lzxOffset < end)
+            {
+                if (lzxStreamDecompress(lzxStream, end - lzxOffset) != 0)
+                    return false;
+
+                lzxOffset = end;
+            }
+        }
+
+        return true;
+    }
+};
+
+static std::unique_ptr<Xex2ImageLoader> Xex2CreateImageLoader(const uint8_t* data, size_t dataSize, size_t imageSize, uint8_t* imageData)
+{
+    auto* header = reinterpret_cast<const Xex2Header*>(data);
+    auto* security = reinterpret_cast<const Xex2SecurityInfo*>(data + header->securityOffset);
+    const auto* fileFormatInfo = reinterpret_cast<const Xex2OptFileFormatInfo*>(getOptHeaderPtr(data, XEX_HEADER_FILE_FORMAT_INFO));
+
+    auto loader = std::make_unique<Xex2ImageLoader>(imageSize);
+    loader->compressionType = fileFormatInfo->compressionType;
+    loader->payload = data + header->headerSize;
+    loader->payloadSize = dataSize - header->headerSize;
+    loader->encrypted = fileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL;
+
+    if (loader->encrypted)
+    {
+        AES_ctx aesContext;
+        memcpy(loader->key, security->aesKey, sizeof(loader->key));
+        AES_init_ctx_iv(&aesContext, Xex2RetailKey, AESBlankIV);
+        AES_CBC_decrypt_buffer(&aesContext, loader->key, sizeof(loader->key));
+    }
+
+    if (fileFormatInfo->compressionType == XEX_COMPRESSION_BASIC)
+    {
+        const auto* blocks = reinterpret_cast<const Xex2FileBasicCompressionBlock*>(fileFormatInfo + 1);
+        const size_t numBlocks = (fileFormatInfo->infoSize / sizeof(Xex2FileBasicCompressionInfo)) - 1;
+
+        size_t srcOffset = 0;
+        size_t destOffset = 0;
+        for (size_t i = 0; i < numBlocks; i++)
+        {
+            loader->basicBlocks.push_back({ srcOffset, destOffset, blocks[i].dataSize, blocks[i].zeroSize });
+            srcOffset += blocks[i].dataSize;
+            destOffset += blocks[i].dataSize + blocks[i].zeroSize;
+        }
+    }
+    else if (fileFormatInfo->compressionType == XEX_COMPRESSION_NORMAL)
+    {
+        // The LZX chunks are found by walking the compressed blocks, so an encrypted payload gets decrypted as a whole.
+        if (loader->encrypted)
+        {
+            loader->decryptedPayload = std::make_unique<uint8_t[]>(loader->payloadSize);
+            memcpy(loader->decryptedPayload.get(), loader->payload, loader->payloadSize);
+            AesCbcDecrypt(loader->key, AESBlankIV, loader->decryptedPayload.get(), loader->payloadSize);
+            loader->payload = loader->decryptedPayload.get();
+            loader->encrypted = false;
+        }
+
+        const auto* compressionInfo = (const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1);
+        if (!Xex2FindCompressedChunks(compressionInfo->firstBlock, loader->payload, loader->payloadSize, loader->chunks))
+            return nullptr;
+
+        loader->lzxStream = lzxStreamCreate(loader->chunks.data(), loader->chunks.size(), imageData, imageSize, compressionInfo->windowSize);
+        if (loader->lzxStream == nullptr)
+            return nullptr;
+    }
+    else if (fileFormatInfo->compressionType != XEX_COMPRESSION_NONE)
+    {
+        return nullptr;
+    }
+
+    return loader;
+}
+
+Image Xex2LoadImage(const uint8_t* data, size_t dataSize, bool lazy)
 {
     auto* header = reinterpret_cast<const Xex2Header*>(data);
     auto* security = reinterpret_cast<const Xex2SecurityInfo*>(data + header->securityOffset);
@@ -139,8 +358,47 @@ Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
     {
         assert(fileFormatInfo->compressionType <= XEX_COMPRESSION_NORMAL);
 
-        std::unique_ptr<uint8_t[]> decryptedData;
-        const uint8_t* srcData = nullptr;
+        const auto* basicBlocks = reinterpret_cast<const Xex2FileBasicCompressionBlock*>(fileFormatInfo + 1);
+        const size_t numBasicBlocks = (fileFormatInfo->infoSize / sizeof(Xex2FileBasicCompressionInfo)) - 1;
+
+        if (fileFormatInfo->compressionType == XEX_COMPRESSION_BASIC)
+        {
+            imageSize = 0;
+            for (size_t i = 0; i < numBasicBlocks; i++)
+            {
+                imageSize += basicBlocks[i].dataSize + basicBlocks[i].zeroSize;
+            }
+        }
+    }
+
+    if (fileFormatInfo != nullptr && lazy)
+    {
+        // Left uninitialized, so the pages that never get decoded aren't backed by memory.
+        result = std::unique_ptr<uint8_t[]>(new uint8_t[imageSize]);
+        image.loader = Xex2CreateImageLoader(data, dataSize, imageSize, result.get());
+        if (image.loader == nullptr)
+            return {};
+    }
+    else if (fileFormatInfo != nullptr)
+    {
+        const auto* basicBlocks = reinterpret_cast<const Xex2FileBasicCompressionBlock*>(fileFormatInfo + 1);
+        const size_t numBasicBlocks = (fileFormatInfo->infoSize / sizeof(Xex2FileBasicCompressionInfo)) - 1;
+
+        // The input can be a read-only file mapping, so the payload gets copied once into a buffer that is
+        // decrypted and decompressed in place, and becomes the image unless it's LZX compressed.
+        // An unencrypted LZX payload is streamed into the image straight from the input instead.
+        const size_t srcSize = dataSize - header->headerSize;
+        const uint8_t* srcData = data + header->headerSize;
+        std::unique_ptr<uint8_t[]> payload;
+
+        if (fileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL || fileFormatInfo->compressionType != XEX_COMPRESSION_NORMAL)
+        {
+            const size_t payloadSize = fileFormatInfo->compressionType == XEX_COMPRESSION_NORMAL ? srcSize : std::max(srcSize, imageSize);
+
+            payload = std::make_unique<uint8_t[]>(payloadSize);
+            memcpy(payload.get(), srcData, srcSize);
+            srcData = payload.get();
+        }
 
         if (fileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL)
         {
@@ -152,105 +410,52 @@ Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
             AES_init_ctx_iv(&aesContext, Xex2RetailKey, AESBlankIV);
             AES_CBC_decrypt_buffer(&aesContext, decryptedKey, KeySize);
 
-            decryptedData = std::make_unique<uint8_t[]>(dataSize - header->headerSize);
-            memcpy(decryptedData.get(), data + header->headerSize, dataSize - header->headerSize);
-            AES_init_ctx_iv(&aesContext, decryptedKey, AESBlankIV);
-            AES_CBC_decrypt_buffer(&aesContext, decryptedData.get(), dataSize - header->headerSize);
-
-            srcData = decryptedData.get();
-        }
-        else
-        {
-            srcData = data + header->headerSize;
+            AesCbcDecrypt(decryptedKey, AESBlankIV, payload.get(), srcSize);
         }
 
         if (fileFormatInfo->compressionType == XEX_COMPRESSION_NONE)
         {
-            result = std::make_unique<uint8_t[]>(imageSize);
-            memcpy(result.get(), srcData, imageSize);
+            result = std::move(payload);
         }
         else if (fileFormatInfo->compressionType == XEX_COMPRESSION_BASIC)
         {
-            auto* blocks = reinterpret_cast<const Xex2FileBasicCompressionBlock*>(fileFormatInfo + 1);
-            const size_t numBlocks = (fileFormatInfo->infoSize / sizeof(Xex2FileBasicCompressionInfo)) - 1;
+            // Blocks only ever move forward, so expanding them from the last one
+            // never overwrites the data of a block that hasn't been moved yet.
+            size_t srcOffset = 0;
+            size_t destOffset = 0;
 
-            imageSize = 0;
-            for (size_t i = 0; i < numBlocks; i++)
+            for (size_t i = 0; i < numBasicBlocks; i++)
             {
-                imageSize += blocks[i].dataSize + blocks[i].zeroSize;
+                srcOffset += basicBlocks[i].dataSize;
+                destOffset += basicBlocks[i].dataSize + basicBlocks[i].zeroSize;
             }
 
-            result = std::make_unique<uint8_t[]>(imageSize);
-            auto* destData = result.get();
-
-            for (size_t i = 0; i < numBlocks; i++)
+            for (size_t i = numBasicBlocks; i-- > 0;)
             {
-                memcpy(destData, srcData, blocks[i].dataSize);
+                srcOffset -= basicBlocks[i].dataSize;
+                destOffset -= basicBlocks[i].dataSize + basicBlocks[i].zeroSize;
 
-                srcData += blocks[i].dataSize;
-                destData += blocks[i].dataSize;
-
-                memset(destData, 0, blocks[i].zeroSize);
-                destData += blocks[i].zeroSize;
+                memmove(payload.get() + destOffset, payload.get() + srcOffset, basicBlocks[i].dataSize);
+                memset(payload.get() + destOffset + basicBlocks[i].dataSize, 0, basicBlocks[i].zeroSize);
             }
+
+            result = std::move(payload);
         }
         else if (fileFormatInfo->compressionType == XEX_COMPRESSION_NORMAL)
         {
             result = std::make_unique<uint8_t[]>(imageSize);
             auto* destData = result.get();
 
-            const Xex2CompressedBlockInfo* blocks = &((const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1))->firstBlock;
-            const uint32_t headerSize = header->headerSize.get();
-
-            const uint32_t exeLength = dataSize - headerSize;
-            const uint8_t* exeBuffer = srcData;
-
-            auto compressBuffer = std::make_unique<uint8_t[]>(exeLength);
-            const uint8_t* p = NULL;
-            uint8_t* d = NULL;
-            sha1::SHA1 s;
-
-            p = exeBuffer;
-            d = compressBuffer.get();
-
-            uint8_t blockCalcedDigest[0x14];
-            while (blocks->blockSize) 
-            {
-                const uint8_t* pNext = p + blocks->blockSize;
-                const auto* nextBlock = (const Xex2CompressedBlockInfo*)p;
-
-                s.reset();
-                s.processBytes(p, blocks->blockSize);
-                s.finalize(blockCalcedDigest);
-
-                if (memcmp(blockCalcedDigest, blocks->blockHash, 0x14) != 0)
-                    return {};
-
-                p += 4;
-                p += 20;
-
-                while (true) 
-                {
-                    const size_t chunkSize = (p[0] << 8) | p[1];
-                    p += 2;
-
-                    if (!chunkSize)
-                        break;
-
-                    memcpy(d, p, chunkSize);
-                    p += chunkSize;
-                    d += chunkSize;
-                }
-
-                p = pNext;
-                blocks = nextBlock;
-            }
+            const auto* compressionInfo = (const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1);
+            std::vector<LzxChunk> chunks;
+            if (!Xex2FindCompressedChunks(compressionInfo->firstBlock, srcData, srcSize, chunks))
+                return {};
 
             int resultCode = 0;
             uint32_t uncompressedSize = security->imageSize;
             uint8_t* buffer = destData;
 
-            resultCode = lzxDecompress(compressBuffer.get(), d - compressBuffer.get(), buffer, uncompressedSize, ((const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1))->windowSize, nullptr, 0);
+            resultCode = lzxDecompress(chunks.data(), chunks.size(), buffer, uncompressedSize, compressionInfo->windowSize, nullptr, 0);
 
             if (resultCode)
                 return {};
@@ -260,8 +465,14 @@ Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
     image.data = std::move(result);
     image.size = security->imageSize;
 
-    // Map image
+    // Map image, a lazily loaded image that fails to decode its headers or code is no image at all
+    if (!image.Load(0, sizeof(IMAGE_DOS_HEADER)))
+        return {};
+
     const auto* dosHeader = reinterpret_cast<IMAGE_DOS_HEADER*>(image.data.get());
+    if (!image.Load(dosHeader->e_lfanew, sizeof(IMAGE_NT_HEADERS32)))
+        return {};
+
     const auto* ntHeaders = reinterpret_cast<IMAGE_NT_HEADERS32*>(image.data.get() + dosHeader->e_lfanew);
 
     image.base = security->loadAddress;
@@ -278,6 +489,8 @@ Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
 
     const auto numSections = ntHeaders->FileHeader.NumberOfSections;
     const auto* sections = reinterpret_cast<const IMAGE_SECTION_HEADER*>(ntHeaders + 1);
+    if (!image.Load(dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS32), numSections * sizeof(IMAGE_SECTION_HEADER)))
+        return {};
 
     for (size_t i = 0; i < numSections; i++)
     {
@@ -291,6 +504,12 @@ Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
 
         image.Map(reinterpret_cast<const char*>(section.Name), section.VirtualAddress, 
             section.Misc.VirtualSize, flags, image.data.get() + section.VirtualAddress);
+
+        // Code sections are walked directly through their data, so they can't wait to be decoded on first access.
+        if ((flags & SectionFlags_Code) && !image.Load(section.VirtualAddress, section.Misc.VirtualSize))
+        {
+            return {};
+        }
     }
 
     auto* imports = reinterpret_cast<const Xex2ImportHeader*>(getOptHeaderPtr(data, XEX_HEADER_IMPORT_LIBRARIES));
@@ -327,6 +546,11 @@ Image Xex2LoadImage(const uint8_t* data, size_t dataSize)
             for (size_t im = 0; im < library->numberOfImports; im++)
             {
                 auto originalThunk = (Xex2ThunkData*)image.Find(descriptors[im].firstThunk);
+                if (originalThunk == nullptr)
+                {
+                    continue;
+                }
+
                 auto originalData = originalThunk;
                 originalData->data = ByteSwap(originalData->data);
 
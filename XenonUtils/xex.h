@@ -1,5 +1,6 @@
 #pragma once
 #include <memory>
+#include <vector>
 #include "xbox.h"
 
 inline constexpr uint8_t Xex2RetailKey[16] = { 0x20, 0xB1, 0x85, 0xA5, 0x9D, 0x28, 0xFD, 0xC3, 0x40, 0x58, 0x3F, 0xBB, 0x08, 0x96, 0xBF, 0x91 };
@@ -264,4 +265,9 @@ inline const void* getOptHeaderPtr(const uint8_t* moduleBytes, uint32_t headerKe
 }
 
 struct Image;
-Image Xex2LoadImage(const uint8_t* data, size_t dataSize);
+struct LzxChunk;
+Image Xex2LoadImage(const uint8_t* data, size_t dataSize, bool lazy = false);
+
+// Verifies the blocks of a normal compressed payload and lists their LZX chunks in order.
+// Returns false if the payload is damaged.
+bool Xex2FindCompressedChunks(const Xex2CompressedBlockInfo& firstBlock, const uint8_t* data, size_t dataSize, std::vector<LzxChunk>& chunks);
@@ -15,56 +15,53 @@
 #include <bit>
 #include <cassert>
 #include <climits>
+#include <cstring>
 #include <fstream>
 
 #include <aes.hpp>
+#include <aes_cbc.h>
 #include <lzx.h>
 #include <mspack.h>
-#include <TinySHA1.hpp>
+#include <sha1.h>
 
 #include "memory_mapped_file.h"
 
+// Input file that reads a list of chunks back to back, so split LZX data doesn't need to be concatenated first.
+struct mspack_chunk_file
+{
+    const LzxChunk *chunks;
+    size_t chunkCount;
+    size_t chunkIndex;
+    size_t offset;
+};
+
 struct mspack_memory_file
 {
-    mspack_system sys;
     void *buffer;
     size_t bufferSize;
     size_t offset;
 };
 
-static mspack_memory_file *mspack_memory_open(mspack_system *sys, void *buffer, size_t bufferSize)
+static int mspack_chunk_read(mspack_file *file, void *buffer, int chars)
 {
-    assert(bufferSize < INT_MAX);
+    mspack_chunk_file *chunkFile = (mspack_chunk_file *)(file);
+    size_t total = 0;
 
-    if (bufferSize >= INT_MAX)
+    while (total < size_t(chars) && chunkFile->chunkIndex < chunkFile->chunkCount)
     {
-        return nullptr;
-    }
+        const auto &chunk = chunkFile->chunks[chunkFile->chunkIndex];
+        const size_t count = std::min(size_t(chars) - total, chunk.size - chunkFile->offset);
+        std::memcpy((uint8_t *)(buffer) + total, chunk.data + chunkFile->offset, count);
+        total += count;
+        chunkFile->offset += count;
 
-    mspack_memory_file *memoryFile = (mspack_memory_file *)(std::calloc(1, sizeof(mspack_memory_file)));
-    if (memoryFile == nullptr)
-    {
-        return memoryFile;
+        if (chunkFile->offset == chunk.size)
+        {
+            chunkFile->chunkIndex++;
+            chunkFile->offset = 0;
+        }
     }
 
-    memoryFile->buffer = buffer;
-    memoryFile->bufferSize = bufferSize;
-    memoryFile->offset = 0;
-    return memoryFile;
-}
-
-static void mspack_memory_close(mspack_memory_file *file)
-{
-    std::free(file);
-}
-
-static int mspack_memory_read(mspack_file *file, void *buffer, int chars)
-{
-    mspack_memory_file *memoryFile = (mspack_memory_file *)(file);
-    const size_t remaining = memoryFile->bufferSize - memoryFile->offset;
-    const size_t total = std::min(size_t(chars), remaining);
-    std::memcpy(buffer, (uint8_t *)(memoryFile->buffer) + memoryFile->offset, total);
-    memoryFile->offset += total;
     return int(total);
 }
 
@@ -93,25 +90,20 @@ static void mspack_memory_copy(void *src, void *dest, size_t chars)
     std::memcpy(dest, src, chars);
 }
 
-static mspack_system *mspack_memory_sys_create()
+static mspack_system *mspack_memory_sys()
 {
-    auto sys = (mspack_system *)(std::calloc(1, sizeof(mspack_system)));
-    if (!sys)
-    {
-        return nullptr;
-    }
-
-    sys->read = mspack_memory_read;
-    sys->write = mspack_memory_write;
-    sys->alloc = mspack_memory_alloc;
-    sys->free = mspack_memory_free;
-    sys->copy = mspack_memory_copy;
-    return sys;
-}
-
-static void mspack_memory_sys_destroy(struct mspack_system *sys)
-{
-    free(sys);
+    static mspack_system sys = []()
+        {
+            mspack_system sys{};
+            sys.read = mspack_chunk_read;
+            sys.write = mspack_memory_write;
+            sys.alloc = mspack_memory_alloc;
+            sys.free = mspack_memory_free;
+            sys.copy = mspack_memory_copy;
+            return sys;
+        }();
+
+    return &sys;
 }
 
 #if defined(_WIN32)
@@ -141,7 +133,7 @@ inline bool bitScanForward(uint64_t v, uint32_t *outFirstSetIndex)
 }
 #endif
 
-int lzxDecompress(const void *lzxData, size_t lzxLength, void *dst, size_t dstLength, uint32_t windowSize, void *windowData, size_t windowDataLength)
+int lzxDecompress(const LzxChunk *chunks, size_t chunkCount, void *dst, size_t dstLength, uint32_t windowSize, void *windowData, size_t windowDataLength)
 {
     int resultCode = 1;
     uint32_t windowBits;
@@ -149,10 +141,14 @@ int lzxDecompress(const void *lzxData, size_t lzxLength, void *dst, size_t dstLe
         return resultCode;
     }
 
-    mspack_system *sys = mspack_memory_sys_create();
-    mspack_memory_file *lzxSrc = mspack_memory_open(sys, (void *)(lzxData), lzxLength);
-    mspack_memory_file *lzxDst = mspack_memory_open(sys, dst, dstLength);
-    lzxd_stream *lzxd = lzxd_init(sys, (mspack_file *)(lzxSrc), (mspack_file *)(lzxDst), windowBits, 0, 0x8000, dstLength, 0);
+    assert(dstLength < INT_MAX);
+    if (dstLength >= INT_MAX) {
+        return resultCode;
+    }
+
+    mspack_chunk_file lzxSrc{ chunks, chunkCount, 0, 0 };
+    mspack_memory_file lzxDst{ dst, dstLength, 0 };
+    lzxd_stream *lzxd = lzxd_init(mspack_memory_sys(), (mspack_file *)(&lzxSrc), (mspack_file *)(&lzxDst), windowBits, 0, 0x8000, dstLength, 0);
     if (lzxd != nullptr) {
         if (windowData != nullptr) {
             size_t paddingLength = windowSize - windowDataLength;
@@ -165,19 +161,49 @@ int lzxDecompress(const void *lzxData, size_t lzxLength, void *dst, size_t dstLe
         lzxd_free(lzxd);
     }
 
-    if (lzxSrc) {
-        mspack_memory_close(lzxSrc);
-    }
+    return resultCode;
+}
 
-    if (lzxDst) {
-        mspack_memory_close(lzxDst);
+int lzxDecompress(const void *lzxData, size_t lzxLength, void *dst, size_t dstLength, uint32_t windowSize, void *windowData, size_t windowDataLength)
+{
+    const LzxChunk chunk{ (const uint8_t *)(lzxData), lzxLength };
+    return lzxDecompress(&chunk, 1, dst, dstLength, windowSize, windowData, windowDataLength);
+}
+
+struct LzxStream
+{
+    mspack_chunk_file source;
+    mspack_memory_file destination;
+    lzxd_stream *lzxd;
+};
+
+LzxStream *lzxStreamCreate(const LzxChunk *chunks, size_t chunkCount, void *dst, size_t dstLength, uint32_t windowSize)
+{
+    uint32_t windowBits;
+    if (!bitScanForward(windowSize, &windowBits) || dstLength >= INT_MAX) {
+        return nullptr;
     }
 
-    if (sys) {
-        mspack_memory_sys_destroy(sys);
+    // The lzxd stream keeps pointers to the files, so they live alongside it.
+    LzxStream *stream = new LzxStream{ { chunks, chunkCount, 0, 0 }, { dst, dstLength, 0 }, nullptr };
+    stream->lzxd = lzxd_init(mspack_memory_sys(), (mspack_file *)(&stream->source), (mspack_file *)(&stream->destination), windowBits, 0, 0x8000, dstLength, 0);
+    if (stream->lzxd == nullptr) {
+        delete stream;
+        return nullptr;
     }
 
-    return resultCode;
+    return stream;
+}
+
+int lzxStreamDecompress(LzxStream *stream, size_t length)
+{
+    return lzxd_decompress(stream->lzxd, length);
+}
+
+void lzxStreamDestroy(LzxStream *stream)
+{
+    lzxd_free(stream->lzxd);
+    delete stream;
 }
 
 static int lzxDeltaApplyPatch(const Xex2DeltaPatch *deltaPatch, uint32_t patchLength, uint32_t windowSize, uint8_t *dstData)
@@ -290,34 +316,24 @@ XexPatcher::Result XexPatcher::apply(const uint8_t* xexBytes, size_t xexBytesSiz
     }
 
     // Create the bytes for the new XEX header. Copy over the existing data.
+    // The header is patched in a buffer of its own, so the output only gets allocated once the size of the new image is known.
     uint32_t newXexHeaderSize = std::max(headerTargetSize, xexHeader->headerSize.get());
-    outBytes.resize(newXexHeaderSize);
-    memset(outBytes.data(), 0, newXexHeaderSize);
-    memcpy(outBytes.data(), xexBytes, headerTargetSize);
+    std::vector<uint8_t> newHeaderBytes(newXexHeaderSize);
+    memcpy(newHeaderBytes.data(), xexBytes, headerTargetSize);
 
-    Xex2Header *newXexHeader = (Xex2Header *)(outBytes.data());
     if (patchDescriptor->deltaHeadersSourceOffset > 0)
     {
-        memcpy(&outBytes[patchDescriptor->deltaHeadersTargetOffset], &outBytes[patchDescriptor->deltaHeadersSourceOffset], patchDescriptor->deltaHeadersSourceSize);
+        memcpy(&newHeaderBytes[patchDescriptor->deltaHeadersTargetOffset], &newHeaderBytes[patchDescriptor->deltaHeadersSourceOffset], patchDescriptor->deltaHeadersSourceSize);
     }
 
-    int resultCode = lzxDeltaApplyPatch(&patchDescriptor->info, patchDescriptor->size, ((const Xex2FileNormalCompressionInfo*)(patchFileFormatInfo + 1))->windowSize, outBytes.data());
+    int resultCode = lzxDeltaApplyPatch(&patchDescriptor->info, patchDescriptor->size, ((const Xex2FileNormalCompressionInfo*)(patchFileFormatInfo + 1))->windowSize, newHeaderBytes.data());
     if (resultCode != 0)
     {
         return Result::PatchFailed;
     }
 
-    // Make the header the specified size by the patch.
-    outBytes.resize(headerTargetSize);
-    newXexHeader = (Xex2Header *)(outBytes.data());
-
-    // Copy the rest of the data.
-    const Xex2SecurityInfo *newSecurityInfo = (const Xex2SecurityInfo *)(&outBytes[newXexHeader->securityOffset]);
-    outBytes.resize(outBytes.size() + newSecurityInfo->imageSize);
-    memset(&outBytes[headerTargetSize], 0, outBytes.size() - headerTargetSize);
-    memcpy(&outBytes[headerTargetSize], &xexBytes[xexHeader->headerSize], xexBytesSize - xexHeader->headerSize);
-    newXexHeader = (Xex2Header *)(outBytes.data());
-    newSecurityInfo = (const Xex2SecurityInfo *)(&outBytes[newXexHeader->securityOffset]);
+    const Xex2Header *newXexHeader = (const Xex2Header *)(newHeaderBytes.data());
+    const Xex2SecurityInfo *newSecurityInfo = (const Xex2SecurityInfo *)(&newHeaderBytes[newXexHeader->securityOffset]);
     
     // Decrypt the keys and validate that the patch is compatible with the base file.
     constexpr uint32_t KeySize = 16;
@@ -351,119 +367,114 @@ XexPatcher::Result XexPatcher::apply(const uint8_t* xexBytes, size_t xexBytesSiz
         return Result::PatchIncompatible;
     }
 
-    // Don't process the rest of the patch.
+    // Don't process the rest of the patch, the output only holds the new header.
     if (skipData)
     {
+        newHeaderBytes.resize(headerTargetSize);
+        outBytes = std::move(newHeaderBytes);
         return Result::Success;
     }
     
-    // Decrypt base XEX if necessary.
     const Xex2OptFileFormatInfo *fileFormatInfo = (const Xex2OptFileFormatInfo *)(getOptHeaderPtr(xexBytes, XEX_HEADER_FILE_FORMAT_INFO));
     if (fileFormatInfo == nullptr)
     {
         return Result::XexFileInvalid;
     }
 
-    if (fileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL)
-    {
-        AES_init_ctx_iv(&aesContext, decryptedOriginalKey, AESBlankIV);
-        AES_CBC_decrypt_buffer(&aesContext, &outBytes[headerTargetSize], xexBytesSize - xexHeader->headerSize);
-    }
-    else if (fileFormatInfo->encryptionType != XEX_ENCRYPTION_NONE)
+    if (fileFormatInfo->encryptionType != XEX_ENCRYPTION_NORMAL && fileFormatInfo->encryptionType != XEX_ENCRYPTION_NONE)
     {
         return Result::XexFileInvalid;
     }
 
-    // Decompress base XEX if necessary.
-    if (fileFormatInfo->compressionType == XEX_COMPRESSION_BASIC)
-    {
-        const Xex2FileBasicCompressionBlock *blocks = &((const Xex2FileBasicCompressionInfo*)(fileFormatInfo + 1))->firstBlock;
-        int32_t numBlocks = (fileFormatInfo->infoSize / sizeof(Xex2FileBasicCompressionBlock)) - 1;
-        int32_t baseCompressedSize = 0;
-        int32_t baseImageSize = 0;
-        for (int32_t i = 0; i < numBlocks; i++) {
-            baseCompressedSize += blocks[i].dataSize;
-            baseImageSize += blocks[i].dataSize + blocks[i].zeroSize;
-        }
+    // Allocate the whole output at once, the base image gets decoded straight into it and patched in place.
+    const uint32_t exeLength = xexBytesSize - xexHeader->headerSize.get();
+    outBytes.clear();
+    outBytes.resize(size_t(headerTargetSize) + newSecurityInfo->imageSize);
+    memcpy(outBytes.data(), newHeaderBytes.data(), headerTargetSize);
+    newHeaderBytes = {};
 
-        if (outBytes.size() < (headerTargetSize + baseImageSize))
-        {
-            return Result::XexFileInvalid;
-        }
-        
-        // Reverse iteration allows to perform this decompression in place.
-        uint8_t *srcDataCursor = outBytes.data() + headerTargetSize + baseCompressedSize;
-        uint8_t *outDataCursor = outBytes.data() + headerTargetSize + baseImageSize;
-        for (int32_t i = numBlocks - 1; i >= 0; i--)
+    uint8_t *outExe = &outBytes[headerTargetSize];
+    newXexHeader = (const Xex2Header *)(outBytes.data());
+    newSecurityInfo = (const Xex2SecurityInfo *)(&outBytes[newXexHeader->securityOffset]);
+
+    // Decrypt and decompress base XEX if necessary.
+    if (fileFormatInfo->compressionType == XEX_COMPRESSION_NORMAL)
+    {
+        // The LZX chunks are read from the payload while the image is written to the output,
+        // so only an encrypted payload needs a buffer of its own to be decrypted in.
+        const uint8_t *exeBuffer = &xexBytes[xexHeader->headerSize];
+        std::unique_ptr<uint8_t[]> decryptedBuffer;
+        if (fileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL)
         {
-            outDataCursor -= blocks[i].zeroSize;
-            memset(outDataCursor, 0, blocks[i].zeroSize);
-            outDataCursor -= blocks[i].dataSize;
-            srcDataCursor -= blocks[i].dataSize;
-            memmove(outDataCursor, srcDataCursor, blocks[i].dataSize);
+            decryptedBuffer = std::make_unique<uint8_t[]>(exeLength);
+            memcpy(decryptedBuffer.get(), exeBuffer, exeLength);
+            AesCbcDecrypt(decryptedOriginalKey, AESBlankIV, decryptedBuffer.get(), exeLength);
+            exeBuffer = decryptedBuffer.get();
         }
-    }
-    else if (fileFormatInfo->compressionType == XEX_COMPRESSION_NORMAL)
-    {
-        const Xex2CompressedBlockInfo* blocks = &((const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1))->firstBlock;
-        const uint32_t exeLength = xexBytesSize - xexHeader->headerSize.get();
-        const uint8_t* exeBuffer = &outBytes[headerTargetSize];
 
-        auto compressBuffer = std::make_unique<uint8_t[]>(exeLength);
-        const uint8_t* p = NULL;
-        uint8_t* d = NULL;
-        sha1::SHA1 s;
+        const auto* compressionInfo = (const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1);
+        std::vector<LzxChunk> chunks;
+        if (!Xex2FindCompressedChunks(compressionInfo->firstBlock, exeBuffer, exeLength, chunks))
+            return Result::PatchFailed;
 
-        p = exeBuffer;
-        d = compressBuffer.get();
+        int resultCode = 0;
+        uint32_t uncompressedSize = originalSecurityInfo->imageSize;
+        if (uncompressedSize > newSecurityInfo->imageSize)
+            return Result::PatchIncompatible;
 
-        uint8_t blockCalcedDigest[0x14];
-        while (blocks->blockSize) 
+        resultCode = lzxDecompress(chunks.data(), chunks.size(), outExe, uncompressedSize, compressionInfo->windowSize, nullptr, 0);
+
+        if (resultCode)
+            return Result::PatchFailed;
+    }
+    else if (fileFormatInfo->compressionType == XEX_COMPRESSION_BASIC || fileFormatInfo->compressionType == XEX_COMPRESSION_NONE)
+    {
+        if (exeLength > newSecurityInfo->imageSize)
         {
-            const uint8_t* pNext = p + blocks->blockSize;
-            const auto* nextBlock = (const Xex2CompressedBlockInfo*)p;
+            return Result::PatchIncompatible;
+        }
 
-            s.reset();
-            s.processBytes(p, blocks->blockSize);
-            s.finalize(blockCalcedDigest);
+        memcpy(outExe, &xexBytes[xexHeader->headerSize], exeLength);
 
-            if (memcmp(blockCalcedDigest, blocks->blockHash, 0x14) != 0)
-                return Result::PatchFailed;
+        if (fileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL)
+        {
+            AesCbcDecrypt(decryptedOriginalKey, AESBlankIV, outExe, exeLength);
+        }
 
-            p += 4;
-            p += 20;
+        if (fileFormatInfo->compressionType == XEX_COMPRESSION_BASIC)
+        {
+            const Xex2FileBasicCompressionBlock *blocks = &((const Xex2FileBasicCompressionInfo*)(fileFormatInfo + 1))->firstBlock;
+            int32_t numBlocks = (fileFormatInfo->infoSize / sizeof(Xex2FileBasicCompressionBlock)) - 1;
+            int32_t baseCompressedSize = 0;
+            int32_t baseImageSize = 0;
+            for (int32_t i = 0; i < numBlocks; i++) {
+                baseCompressedSize += blocks[i].dataSize;
+                baseImageSize += blocks[i].dataSize + blocks[i].zeroSize;
+            }
 
-            while (true) 
+            if (outBytes.size() < (headerTargetSize + baseImageSize))
             {
-                const size_t chunkSize = (p[0] << 8) | p[1];
-                p += 2;
-
-                if (!chunkSize)
-                    break;
-
-                memcpy(d, p, chunkSize);
-                p += chunkSize;
-                d += chunkSize;
+                return Result::XexFileInvalid;
+            }
+            
+            // Reverse iteration allows to perform this decompression in place.
+            uint8_t *srcDataCursor = outExe + baseCompressedSize;
+            uint8_t *outDataCursor = outExe + baseImageSize;
+            for (int32_t i = numBlocks - 1; i >= 0; i--)
+            {
+                outDataCursor -= blocks[i].zeroSize;
+                memset(outDataCursor, 0, blocks[i].zeroSize);
+                outDataCursor -= blocks[i].dataSize;
+                srcDataCursor -= blocks[i].dataSize;
+                memmove(outDataCursor, srcDataCursor, blocks[i].dataSize);
             }
-
-            p = pNext;
-            blocks = nextBlock;
         }
-
-        int resultCode = 0;
-        uint32_t uncompressedSize = originalSecurityInfo->imageSize;
-        uint8_t* buffer = outBytes.data() + newXexHeaderSize;
-
-        resultCode = lzxDecompress(compressBuffer.get(), d - compressBuffer.get(), buffer, uncompressedSize, ((const Xex2FileNormalCompressionInfo*)(fileFormatInfo + 1))->windowSize, nullptr, 0);
-
-        if (resultCode)
-            return Result::PatchFailed;
     }
     else if (fileFormatInfo->compressionType == XEX_COMPRESSION_DELTA)
     {
         return Result::XexFileUnsupported;
     }
-    else if (fileFormatInfo->compressionType != XEX_COMPRESSION_NONE)
+    else
     {
         return Result::XexFileInvalid;
     }
@@ -478,15 +489,17 @@ XexPatcher::Result XexPatcher::apply(const uint8_t* xexBytes, size_t xexBytesSiz
     newFileFormatInfo->encryptionType = XEX_ENCRYPTION_NONE;
     newFileFormatInfo->compressionType = XEX_COMPRESSION_NONE;
 
-    // Copy and decrypt patch data if necessary.
-    std::vector<uint8_t> patchData;
-    patchData.resize(patchBytesSize - patchHeader->headerSize);
-    memcpy(patchData.data(), &patchBytes[patchHeader->headerSize], patchData.size());
+    // Copy and decrypt patch data if necessary, unencrypted patch data is read straight from the patch file.
+    const size_t patchDataSize = patchBytesSize - patchHeader->headerSize;
+    const uint8_t *patchDataCursor = &patchBytes[patchHeader->headerSize];
+    std::unique_ptr<uint8_t[]> patchData;
 
     if (patchFileFormatInfo->encryptionType == XEX_ENCRYPTION_NORMAL)
     {
-        AES_init_ctx_iv(&aesContext, decryptedPatchKey, AESBlankIV);
-        AES_CBC_decrypt_buffer(&aesContext, patchData.data(), patchData.size());
+        patchData = std::make_unique<uint8_t[]>(patchDataSize);
+        memcpy(patchData.get(), patchDataCursor, patchDataSize);
+        AesCbcDecrypt(decryptedPatchKey, AESBlankIV, patchData.get(), patchDataSize);
+        patchDataCursor = patchData.get();
     }
     else if (patchFileFormatInfo->encryptionType != XEX_ENCRYPTION_NONE)
     {
@@ -494,7 +507,6 @@ XexPatcher::Result XexPatcher::apply(const uint8_t* xexBytes, size_t xexBytesSiz
     }
 
     const Xex2CompressedBlockInfo *currentBlock = &((const Xex2FileNormalCompressionInfo*)(patchFileFormatInfo + 1))->firstBlock;
-    uint8_t *outExe = &outBytes[newXexHeader->headerSize];
     if (patchDescriptor->deltaImageSourceOffset > 0)
     {
         memcpy(&outExe[patchDescriptor->deltaImageTargetOffset], &outExe[patchDescriptor->deltaImageSourceOffset], patchDescriptor->deltaImageSourceSize);
@@ -502,16 +514,12 @@ XexPatcher::Result XexPatcher::apply(const uint8_t* xexBytes, size_t xexBytesSiz
 
     static const uint32_t DigestSize = 20;
     uint8_t sha1Digest[DigestSize];
-    sha1::SHA1 sha1Context;
-    uint8_t *patchDataCursor = patchData.data();
     while (currentBlock->blockSize > 0)
     {
         const Xex2CompressedBlockInfo *nextBlock = (const Xex2CompressedBlockInfo *)(patchDataCursor);
 
         // Hash and validate the block.
-        sha1Context.reset();
-        sha1Context.processBytes(patchDataCursor, currentBlock->blockSize);
-        sha1Context.finalize(sha1Digest);
+        Sha1Digest(patchDataCursor, currentBlock->blockSize, sha1Digest);
         if (memcmp(sha1Digest, currentBlock->blockHash, DigestSize) != 0)
         {
             return Result::PatchFailed;
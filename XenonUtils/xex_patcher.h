@@ -18,6 +18,22 @@
 
 extern int lzxDecompress(const void* lzxData, size_t lzxLength, void* dst, size_t dstLength, uint32_t windowSize, void* windowData, size_t windowDataLength);
 
+struct LzxChunk
+{
+    const uint8_t* data;
+    size_t size;
+};
+
+// Decompresses LZX data that is split into chunks, reading them in order without concatenating them first.
+extern int lzxDecompress(const LzxChunk* chunks, size_t chunkCount, void* dst, size_t dstLength, uint32_t windowSize, void* windowData, size_t windowDataLength);
+
+// Decompresses LZX data that is split into chunks a piece at a time, every call continuing where the previous one stopped.
+// The chunks and the destination need to outlive the stream.
+struct LzxStream;
+extern LzxStream* lzxStreamCreate(const LzxChunk* chunks, size_t chunkCount, void* dst, size_t dstLength, uint32_t windowSize);
+extern int lzxStreamDecompress(LzxStream* stream, size_t length);
+extern void lzxStreamDestroy(LzxStream* stream);
+
 struct XexPatcher
 {
     enum class Result {
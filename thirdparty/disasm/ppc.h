@@ -22,6 +22,15 @@
 /* A macro to extract the branch operation of an instruction. */
 #define PPC_BO(i) (((i) >> 21) & 0x1F)
 
+/* Macros to extract the register operands of an instruction. */
+#define PPC_RD(i) (((i) >> 21) & 0x1F)
+#define PPC_RA(i) (((i) >> 16) & 0x1F)
+#define PPC_RB(i) (((i) >> 11) & 0x1F)
+
+/* Macros to extract the immediate operand of an instruction. */
+#define PPC_SIMM(i) ((signed int)((((i) & 0xFFFF) ^ 0x8000) - 0x8000))
+#define PPC_UIMM(i) ((i) & 0xFFFF)
+
 #define PPC_OP_TDI 2
 #define PPC_OP_TWI 3
 #define PPC_OP_MULLI 7
@@ -36,3 +45,4 @@
 #define PPC_OP_SC 0x11
 #define PPC_OP_B 0x12
 #define PPC_OP_CTR 0x13
+#define PPC_OP_ORI 0x18